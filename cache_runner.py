@@ -0,0 +1,77 @@
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# Runs a script from a scratch directory several times to check its bytecode
+# cache (<script>.smc) is written, loaded, and thrown away when it is stale or
+# damaged. The script's //expect: lines give the output from source.
+
+def run(interpreter, script):
+    result = subprocess.run([interpreter, script], capture_output=True)
+    return [x.strip() for x in result.stdout.decode().split('\n') if x != '']
+
+def check(name, expected, actual):
+    if expected != actual:
+        print(f"FAIL {name}: Expect: {expected}, Actual: {actual}")
+        return False
+    return True
+
+def test_cache(interpreter, script_to_test):
+    print(f"Running cache test: {script_to_test}")
+    contents = open(script_to_test, 'r').read()
+    expected = [x.replace("//expect:", "").strip() for x in contents.split('\n') if x.startswith("//expect:")]
+
+    directory = tempfile.mkdtemp()
+    try:
+        script = os.path.join(directory, os.path.basename(script_to_test))
+        cache = script + ".smc"
+        shutil.copyfile(script_to_test, script)
+
+        if not check("first run", expected, run(interpreter, script)): return 1
+        if not os.path.exists(cache):
+            print("FAIL: no cache written")
+            return 1
+
+        # the second run must come from the cache: change a string constant
+        # in it, keeping its length, and the change shows in the output
+        data = open(cache, 'rb').read()
+        if data.count(b"from source") != 1:
+            print("FAIL: constant not found in cache")
+            return 1
+        open(cache, 'wb').write(data.replace(b"from source", b"from cache!"))
+        cached = [x.replace("from source", "from cache!") for x in expected]
+        if not check("cached run", cached, run(interpreter, script)): return 1
+
+        # editing the source makes the cache stale
+        open(script, 'w').write(contents + "\nprint \"edited\"\n")
+        if not check("edited run", expected + ["edited"], run(interpreter, script)): return 1
+        if not check("edited cached run", expected + ["edited"], run(interpreter, script)): return 1
+
+        # a damaged cache is ignored and rewritten
+        data = open(cache, 'rb').read()
+        for length in range(0, len(data), max(1, len(data) // 50)):
+            open(cache, 'wb').write(data[:length])
+            if not check(f"truncated to {length}", expected + ["edited"], run(interpreter, script)): return 1
+
+        leftovers = [x for x in os.listdir(directory) if x.endswith(".tmp")]
+        if len(leftovers) > 0:
+            print(f"FAIL: temp files left behind: {leftovers}")
+            return 1
+    finally:
+        shutil.rmtree(directory)
+
+    print("PASS")
+    return 0
+
+# ENTRY POINT #
+args = sys.argv
+
+if len(args) < 3:
+    print("Usage: cache_runner.py [interpeter] [script to test]")
+    exit_code = 64
+else:
+    exit_code = test_cache(os.path.abspath(args[1]) if os.path.exists(args[1]) else args[1], args[2])
+
+sys.exit(exit_code)
@@ -0,0 +1,610 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+// Bump whenever opcodes or the file layout change so old caches are ignored.
+#define CACHE_VERSION 4
+#define CACHE_MAGIC "SMC"
+
+enum {
+    CONST_NIL,
+    CONST_BOOL,
+    CONST_NUMBER,
+    CONST_DATETIME,
+    CONST_STRING,
+    CONST_FUNCTION
+};
+
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    bool failed;
+    int* globals;       // cache global index -> vm global slot
+    int globalCount;
+} Reader;
+
+typedef struct {
+    FILE* file;
+    bool failed;
+    int* globals;       // vm global slot -> cache global index, -1 if unused
+    int globalCapacity;
+    ObjString** names;  // cache global index -> name
+    int globalCount;
+} Writer;
+
+static uint64_t hashSource(const char* source)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = source; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void cachePath(const char* path, char* buffer, size_t size)
+{
+    snprintf(buffer, size, "%s.smc", path);
+}
+
+// Number of bytes taken by the instruction at offset, operands included.
+static int instructionLength(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_INC_LOCAL:
+        case OP_INC_UPVALUE:
+        case OP_DEC_LOCAL:
+        case OP_DEC_UPVALUE:
+        case OP_ADD_LOCAL:
+        case OP_ADD_UPVALUE:
+        case OP_CLOSE_ITER:
+            return 2;
+        case OP_CONSTANT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_CLASS:
+        case OP_MODULE:
+        case OP_METHOD:
+        case OP_ENUM:
+        case OP_ENUM_FIELD:
+        case OP_ENUM_FIELD_SET:
+        case OP_INC_PROPERTY:
+        case OP_DEC_PROPERTY:
+        case OP_ADD_PROPERTY:
+        case OP_NEW_LIST:
+        case OP_NEW_TABLE:
+            return 3;
+        case OP_FOR_ITER:
+        case OP_FOR_RANGE:
+            return 4;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return 5;
+        case OP_INVOKE:
+            return 6;
+        case OP_CLOSURE: {
+            uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 3 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+static bool isGlobalOp(uint8_t instruction)
+{
+    return instruction == OP_DEFINE_GLOBAL || instruction == OP_GET_GLOBAL
+        || instruction == OP_SET_GLOBAL;
+}
+
+// ---- writing ----
+
+static void writeBytes(Writer* writer, const void* bytes, size_t size)
+{
+    if (size > 0 && fwrite(bytes, 1, size, writer->file) != size)
+        writer->failed = true;
+}
+
+static void writeInt(Writer* writer, int32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeString(Writer* writer, ObjString* string)
+{
+    if (string == NULL)
+    {
+        writeInt(writer, -1);
+        return;
+    }
+    writeInt(writer, string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static int globalIndex(Writer* writer, int slot)
+{
+    if (writer->globals[slot] == -1)
+    {
+        writer->names[writer->globalCount] = AS_STRING(vm.globalNames.values[slot]);
+        writer->globals[slot] = writer->globalCount++;
+    }
+    return writer->globals[slot];
+}
+
+// Global operands are vm slots, which differ between runs, so they are
+// written as indexes into the cache's own table of global names.
+static void collectGlobals(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (isGlobalOp(chunk->code[offset]))
+            globalIndex(writer, (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        if (IS_FUNCTION(chunk->constants.values[i]))
+            collectGlobals(writer, AS_FUNCTION(chunk->constants.values[i]));
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+
+    writeString(writer, function->name);
+    writeInt(writer, function->arity);
+    writeInt(writer, function->optionals);
+    writeInt(writer, function->upvalueCount);
+    writeInt(writer, function->cacheCount);
+
+    uint8_t* code = (uint8_t*)malloc(chunk->count + 1);
+    memcpy(code, chunk->code, chunk->count);
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        if (!isGlobalOp(code[offset])) continue;
+
+        int index = writer->globals[(code[offset + 1] << 8) | code[offset + 2]];
+        code[offset + 1] = (index >> 8) & 0xff;
+        code[offset + 2] = index & 0xff;
+    }
+    writeInt(writer, chunk->count);
+    writeBytes(writer, code, chunk->count);
+    writeBytes(writer, chunk->lines, sizeof(int) * chunk->count);
+    free(code);
+
+    writeInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value value = chunk->constants.values[i];
+        uint8_t tag;
+        if (IS_NIL(value))
+        {
+            tag = CONST_NIL;
+            writeBytes(writer, &tag, 1);
+        }
+        else if (IS_BOOL(value))
+        {
+            tag = CONST_BOOL;
+            uint8_t b = AS_BOOL(value);
+            writeBytes(writer, &tag, 1);
+            writeBytes(writer, &b, 1);
+        }
+        else if (IS_NUMBER(value))
+        {
+            tag = CONST_NUMBER;
+            double number = AS_NUMBER(value);
+            writeBytes(writer, &tag, 1);
+            writeBytes(writer, &number, sizeof(number));
+        }
+        else if (IS_DATETIME(value))
+        {
+            tag = CONST_DATETIME;
+            int64_t t = (int64_t)AS_DATETIME(value);
+            writeBytes(writer, &tag, 1);
+            writeBytes(writer, &t, sizeof(t));
+        }
+        else if (IS_STRING(value))
+        {
+            tag = CONST_STRING;
+            writeBytes(writer, &tag, 1);
+            writeString(writer, AS_STRING(value));
+        }
+        else if (IS_FUNCTION(value))
+        {
+            tag = CONST_FUNCTION;
+            writeBytes(writer, &tag, 1);
+            writeFunction(writer, AS_FUNCTION(value));
+        }
+        else
+        {
+            writer->failed = true;
+        }
+    }
+}
+
+void saveBytecode(const char* path, const char* source, ObjFunction* function)
+{
+    char finalPath[1024];
+    char tempPath[1040];
+    cachePath(path, finalPath, sizeof(finalPath));
+    // one temp file per process, so two runs saving at once don't write
+    // into the same file before renaming it
+    snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", finalPath, (int)getpid());
+
+    Writer writer;
+    writer.file = fopen(tempPath, "wb");
+    if (writer.file == NULL) return; // read-only directory, just run uncached
+
+    writer.failed = false;
+    writer.globalCapacity = vm.globalValues.count;
+    writer.globalCount = 0;
+    writer.globals = (int*)malloc(sizeof(int) * (writer.globalCapacity + 1));
+    writer.names = (ObjString**)malloc(sizeof(ObjString*) * (writer.globalCapacity + 1));
+    for (int i = 0; i < writer.globalCapacity; i++)
+        writer.globals[i] = -1;
+
+    collectGlobals(&writer, function);
+
+    writeBytes(&writer, CACHE_MAGIC, 4);
+    writeInt(&writer, CACHE_VERSION);
+    uint64_t hash = hashSource(source);
+    writeBytes(&writer, &hash, sizeof(hash));
+
+    writeInt(&writer, writer.globalCount);
+    for (int i = 0; i < writer.globalCount; i++)
+        writeString(&writer, writer.names[i]);
+
+    writeFunction(&writer, function);
+
+    free(writer.globals);
+    free(writer.names);
+
+    if (fclose(writer.file) != 0) writer.failed = true;
+    if (writer.failed || rename(tempPath, finalPath) != 0)
+        remove(tempPath);
+}
+
+// ---- reading ----
+
+static const uint8_t* readBytes(Reader* reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < size)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += size;
+    return bytes;
+}
+
+static int32_t readInt(Reader* reader)
+{
+    int32_t value = 0;
+    const uint8_t* bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static ObjString* readString(Reader* reader)
+{
+    int32_t length = readInt(reader);
+    if (length < 0) return NULL;
+
+    const uint8_t* chars = readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return internString(copyStringRaw((const char*)chars, length));
+}
+
+static int readShort(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static bool isStringConstant(Chunk* chunk, int constant)
+{
+    return constant < chunk->constants.count && IS_STRING(chunk->constants.values[constant]);
+}
+
+// Where the jump at offset lands, or -1 if it isn't a jump.
+static int jumpTarget(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset])
+    {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            return offset + 3 + readShort(chunk, offset + 1);
+        case OP_LOOP:
+            return offset + 3 - readShort(chunk, offset + 1);
+        case OP_FOR_ITER:
+        case OP_FOR_RANGE:
+            return offset + 4 + readShort(chunk, offset + 2);
+        default:
+            return -1;
+    }
+}
+
+// Checks the operands of the length bytes at offset against the function,
+// so a damaged cache can't make the vm read outside its constants, inline
+// caches, upvalues or frame. Global operands are checked as they are mapped
+// and jumps once every instruction has been found.
+static bool validOperands(ObjFunction* function, int cacheCount, int offset, int length)
+{
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = &chunk->code[offset];
+
+    switch (code[0])
+    {
+        case OP_CONSTANT:
+            return readShort(chunk, offset + 1) < chunk->constants.count;
+        case OP_CLASS:
+        case OP_MODULE:
+        case OP_METHOD:
+        case OP_ENUM:
+        case OP_ENUM_FIELD:
+        case OP_ENUM_FIELD_SET:
+        case OP_INC_PROPERTY:
+        case OP_DEC_PROPERTY:
+        case OP_ADD_PROPERTY:
+            return isStringConstant(chunk, readShort(chunk, offset + 1));
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            return isStringConstant(chunk, readShort(chunk, offset + 1))
+                && readShort(chunk, offset + 3) < cacheCount;
+        case OP_INVOKE:
+            return isStringConstant(chunk, readShort(chunk, offset + 1))
+                && readShort(chunk, offset + 4) < cacheCount;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_INC_UPVALUE:
+        case OP_DEC_UPVALUE:
+        case OP_ADD_UPVALUE:
+            return code[1] < function->upvalueCount;
+        case OP_CLOSURE:
+            // upvalues captured from this function's own must exist in it
+            for (int i = 3; i < length; i += 2)
+            {
+                if (!code[i] && code[i + 1] >= function->upvalueCount) return false;
+            }
+            return true;
+        case OP_FOR_ITER:
+        case OP_FOR_RANGE:
+            // the counter, enumerable and loop variable take three slots
+            return code[1] + 2 < UINT8_COUNT;
+        case OP_CLOSE_ITER:
+            // its operand is the enumerable, followed by the loop variable
+            return code[1] + 1 < UINT8_COUNT;
+        default:
+            // other local slots are a byte, so always within the frame
+            return true;
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader)
+{
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+
+    function->name = readString(reader);
+    if (function->name != NULL) WRITE_BARRIER(function, OBJ_VAL(function->name));
+    function->arity = readInt(reader);
+    function->optionals = readInt(reader);
+    function->upvalueCount = readInt(reader);
+    int cacheCount = readInt(reader);
+
+    Chunk* chunk = &function->chunk;
+    int count = readInt(reader);
+    const uint8_t* code = readBytes(reader, count);
+    const uint8_t* lines = readBytes(reader, sizeof(int) * count);
+    if (reader->failed || count <= 0 || cacheCount < 0
+        || function->arity < 0 || function->arity > 255
+        || function->optionals < 0 || function->optionals > function->arity
+        || function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT)
+    {
+        reader->failed = true;
+        pop();
+        return function;
+    }
+
+    chunk->code = ALLOCATE(uint8_t, count);
+    chunk->lines = ALLOCATE(int, count);
+    memcpy(chunk->code, code, count);
+    memcpy(chunk->lines, lines, sizeof(int) * count);
+    chunk->count = count;
+    chunk->capacity = count;
+
+    int constantCount = readInt(reader);
+    for (int i = 0; i < constantCount && !reader->failed; i++)
+    {
+        const uint8_t* tag = readBytes(reader, 1);
+        if (tag == NULL) break;
+
+        Value value = NIL_VAL;
+        switch (*tag)
+        {
+            case CONST_NIL:
+                break;
+            case CONST_BOOL: {
+                const uint8_t* b = readBytes(reader, 1);
+                if (b != NULL) value = BOOL_VAL(*b != 0);
+                break;
+            }
+            case CONST_NUMBER: {
+                double number = 0;
+                const uint8_t* bytes = readBytes(reader, sizeof(number));
+                if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case CONST_DATETIME: {
+                int64_t t = 0;
+                const uint8_t* bytes = readBytes(reader, sizeof(t));
+                if (bytes != NULL) memcpy(&t, bytes, sizeof(t));
+                value = DATETIME_VAL((time_t)t);
+                break;
+            }
+            case CONST_STRING: {
+                ObjString* string = readString(reader);
+                if (string == NULL) reader->failed = true;
+                else value = OBJ_VAL(string);
+                break;
+            }
+            case CONST_FUNCTION:
+                value = OBJ_VAL(readFunction(reader));
+                break;
+            default:
+                reader->failed = true;
+                break;
+        }
+        addConstant(chunk, value);
+        WRITE_BARRIER(function, value);
+    }
+
+    // map global operands back to this run's slots, checking every operand
+    // against the instruction stream while we're at it
+    bool* starts = (bool*)calloc(chunk->count, sizeof(bool));
+    for (int offset = 0; offset < chunk->count && !reader->failed;)
+    {
+        starts[offset] = true;
+        uint8_t instruction = chunk->code[offset];
+        // OP_CLOSE_ITER is the last opcode; anything past it is unknown
+        if (instruction > OP_CLOSE_ITER) { reader->failed = true; break; }
+        if (instruction == OP_CLOSURE)
+        {
+            // its length depends on the function, so check that first
+            if (offset + 2 >= chunk->count) { reader->failed = true; break; }
+            int constant = readShort(chunk, offset + 1);
+            if (constant >= chunk->constants.count
+                || !IS_FUNCTION(chunk->constants.values[constant]))
+            {
+                reader->failed = true;
+                break;
+            }
+        }
+
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count
+            || !validOperands(function, cacheCount, offset, length))
+        {
+            reader->failed = true;
+            break;
+        }
+
+        if (isGlobalOp(instruction))
+        {
+            int index = readShort(chunk, offset + 1);
+            if (index >= reader->globalCount) { reader->failed = true; break; }
+            int slot = reader->globals[index];
+            chunk->code[offset + 1] = (slot >> 8) & 0xff;
+            chunk->code[offset + 2] = slot & 0xff;
+        }
+        offset += length;
+    }
+
+    // a jump has to land on an instruction, or its operands go unchecked
+    for (int offset = 0; offset < chunk->count && !reader->failed;
+         offset += instructionLength(chunk, offset))
+    {
+        int target = jumpTarget(chunk, offset);
+        if (target != -1 && (target < 0 || target >= chunk->count || !starts[target]))
+            reader->failed = true;
+    }
+    free(starts);
+
+    if (cacheCount > 0 && !reader->failed)
+    {
+        InlineCache* caches = ALLOCATE(InlineCache, cacheCount);
+        memset(caches, 0, sizeof(InlineCache) * cacheCount);
+        function->caches = caches;
+        function->cacheCount = cacheCount;
+    }
+
+    pop();
+    return function;
+}
+
+// Returns the cached top-level function for source, or NULL when there is no
+// cache file or it was written for a different source or interpreter version.
+ObjFunction* loadBytecode(const char* path, const char* source)
+{
+    char fullPath[1024];
+    cachePath(path, fullPath, sizeof(fullPath));
+
+    FILE* file = fopen(fullPath, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    uint8_t* buffer = (uint8_t*)malloc(size > 0 ? size : 1);
+    size_t bytesRead = fread(buffer, 1, size, file);
+    fclose(file);
+
+    Reader reader;
+    reader.current = buffer;
+    reader.end = buffer + bytesRead;
+    reader.failed = false;
+    reader.globals = NULL;
+    reader.globalCount = 0;
+
+    const uint8_t* magic = readBytes(&reader, 4);
+    int version = readInt(&reader);
+    uint64_t hash = 0;
+    const uint8_t* hashBytes = readBytes(&reader, sizeof(hash));
+    if (hashBytes != NULL) memcpy(&hash, hashBytes, sizeof(hash));
+
+    if (reader.failed || memcmp(magic, CACHE_MAGIC, 4) != 0 || version != CACHE_VERSION
+        || hash != hashSource(source))
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    int globalCount = readInt(&reader);
+    if (globalCount < 0 || globalCount > UINT16_T_MAX) reader.failed = true;
+    reader.globals = (int*)malloc(sizeof(int) * (globalCount > 0 ? globalCount : 1));
+    for (int i = 0; i < globalCount && !reader.failed; i++)
+    {
+        ObjString* name = readString(&reader);
+        if (name == NULL) { reader.failed = true; break; }
+        reader.globals[i] = globalSlot(name);
+        reader.globalCount++;
+    }
+
+    ObjFunction* function = reader.failed ? NULL : readFunction(&reader);
+    if (function != NULL && function->arity != 0) reader.failed = true;
+
+    free(reader.globals);
+    free(buffer);
+    return reader.failed ? NULL : function;
+}
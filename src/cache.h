@@ -0,0 +1,9 @@
+#ifndef sm_cache_h
+#define sm_cache_h
+
+#include "object.h"
+
+ObjFunction* loadBytecode(const char* path, const char* source);
+void saveBytecode(const char* path, const char* source, ObjFunction* function);
+
+#endif
@@ -68,7 +68,11 @@ typedef enum {
     OP_ENUM,
     OP_ENUM_FIELD,
     OP_ENUM_FIELD_SET,
-    OP_ENUM_GET
+    OP_ENUM_GET,
+    OP_FOR_ITER,
+    OP_RANGE_BOUND,
+    OP_FOR_RANGE,
+    OP_CLOSE_ITER
 } OpCode;
 
 typedef struct {
@@ -7,6 +7,22 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 
+// The interpreter loop uses threaded dispatch (labels as values) when the
+// compiler supports it. Define NO_COMPUTED_GOTO to force the portable switch.
+//#define NO_COMPUTED_GOTO
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO) && !defined(DEBUG_TRACE_EXECUTION)
+#define COMPUTED_GOTO
+#endif
+
+// Pack every Value into a single 64-bit word using NaN tagging instead of a
+// 16-byte tagged union. Requires pointers that fit in 48 bits.
+//#define NAN_BOXING
+
+// Compiled scripts are saved next to the source as <file>.smc and reused
+// while the source is unchanged. Define NO_BYTECODE_CACHE to always compile.
+//#define NO_BYTECODE_CACHE
+
 #define UINT8_COUNT (255 + 1)
 #define UINT16_T_MAX 0xFFFF
 #define UINT8_T_MAX 0xFF
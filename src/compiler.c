@@ -7,6 +7,7 @@
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -69,15 +70,30 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int cacheCount;
+    uint8_t iterators[UINT8_COUNT]; // enumerable slots of enclosing for-in loops
+    int iteratorCount;
 } Compiler;
 
 typedef struct ClassCompiler {
     struct ClassCompiler* enclosing;
 } ClassCompiler;
 
+// Bytecode span of the last list literal that was a single range, e.g. [a..b],
+// or of the last sql literal. forStatement uses it to iterate the range
+// without building the list, and the query through a cursor.
+typedef struct {
+    Chunk* chunk;
+    int start;
+    int end;
+    int items;  // for a range, where its bounds start after OP_NEW_LIST
+} LiteralSpan;
+
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
+LiteralSpan lastRange;
+LiteralSpan lastSql;
 Chunk* compilingChunk;
 char* currentFilename;
 
@@ -197,6 +213,19 @@ static void emitBytes16(uint8_t byte1, uint16_t byte2)
     emitByte(byte2 & 0xff);
 }
 
+// Reserves an inline cache for the property access or invoke just emitted.
+static void emitCache()
+{
+    if (current->cacheCount == UINT16_T_MAX)
+    {
+        error("Too many property accesses in one function.");
+        return;
+    }
+    int index = current->cacheCount++;
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+}
+
 static void emitLoop(int loopStart) 
 {
     emitByte(OP_LOOP);
@@ -217,9 +246,26 @@ static int emitJump(uint8_t instruction)
     return currentChunk()->count - 2;
 }
 
+// List and table literals start with the number of items they are built
+// with, so the VM can allocate them at their final size.
+static int emitNewCollection(uint8_t instruction)
+{
+    emitBytes16(instruction, 0);
+    return currentChunk()->count - 2;
+}
+
+static void patchItemCount(int offset, int count)
+{
+    if (count > UINT16_T_MAX) count = UINT16_T_MAX;
+
+    currentChunk()->code[offset] = (count >> 8) & 0xff;
+    currentChunk()->code[offset + 1] = count & 0xff;
+}
+
 static uint16_t makeConstant(Value value) 
 {
     int constant = addConstant(currentChunk(), value);
+    WRITE_BARRIER(current->function, value);
     if (constant > UINT16_T_MAX) 
     {
         error("Too many constants in one chunk.");
@@ -271,13 +317,16 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->cacheCount = 0;
+    compiler->iteratorCount = 0;
     compiler->function = newFunction();
     current = compiler;
 
     if (type != TYPE_SCRIPT && type != TYPE_ANON) 
     {
-        current->function->name = copyStringRaw(parser.previous.start,
-                                            parser.previous.length);
+        current->function->name = internString(copyStringRaw(parser.previous.start,
+                                            parser.previous.length));
+        WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->localCount++];
@@ -301,6 +350,14 @@ static ObjFunction* endCompiler()
     emitReturn();
     ObjFunction* function = current->function;
 
+    if (current->cacheCount > 0)
+    {
+        InlineCache* caches = ALLOCATE(InlineCache, current->cacheCount);
+        memset(caches, 0, sizeof(InlineCache) * current->cacheCount);
+        function->caches = caches;
+        function->cacheCount = current->cacheCount;
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) 
     {
@@ -370,8 +427,8 @@ static void call(bool canAssign)
 
 static uint16_t identifierConstant(Token* name) 
 {
-    return makeConstant(OBJ_VAL(copyStringRaw(name->start,
-                                           name->length)));
+    return makeConstant(OBJ_VAL(internString(copyStringRaw(name->start,
+                                           name->length))));
 }
 
 static void dot(bool canAssign) 
@@ -383,6 +440,7 @@ static void dot(bool canAssign)
     {
         expression();
         emitBytes16(OP_SET_PROPERTY, name);
+        emitCache();
     } 
     else if (canAssign && match(TOKEN_PLUS_PLUS))
     {
@@ -408,10 +466,12 @@ static void dot(bool canAssign)
         uint8_t argCount = argumentList();
         emitBytes16(OP_INVOKE, name);
         emitByte(argCount);
+        emitCache();
     }
     else 
     {
         emitBytes16(OP_GET_PROPERTY, name);
+        emitCache();
     }
 }
 
@@ -462,25 +522,36 @@ static void and_(bool canAssign)
 
 static void string(bool canAssign) 
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(internString(copyString(parser.previous.start + 1,
+                                    parser.previous.length - 2))));
 }
 
 static void rawString(bool canAssign) 
 {
-    emitConstant(OBJ_VAL(copyStringRaw(parser.previous.start + 3,
-                                       parser.previous.length - 4)));
+    emitConstant(OBJ_VAL(internString(copyStringRaw(parser.previous.start + 3,
+                                       parser.previous.length - 4))));
 }
 
 static void formatString(bool canAssign) 
 {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                    parser.previous.length - 1)));
+    emitConstant(OBJ_VAL(internString(copyString(parser.previous.start + 1,
+                                    parser.previous.length - 1))));
 }
 
-static uint16_t stringConstant(char* name) 
+static uint16_t globalSlotFor(const char* chars, int length)
 {
-    return makeConstant(OBJ_VAL(copyStringRaw(name,strlen(name))));
+    int slot = globalSlot(internString(copyStringRaw(chars, length)));
+    if (slot > UINT16_T_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
+}
+
+static uint16_t identifierGlobal(Token* name)
+{
+    return globalSlotFor(name->start, name->length);
 }
 
 static bool identifiersEqual(Token* a, Token* b) 
@@ -620,7 +691,7 @@ static void namedVariable(Token name, bool canAssign)
     }
     else 
     {
-        arg = identifierConstant(&name);
+        arg = identifierGlobal(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
 
@@ -697,13 +768,15 @@ static void unary(bool canAssign)
 
 static void hashTable(bool canAssign)
 {
-    emitByte(OP_NEW_TABLE);
+    int sizeOffset = emitNewCollection(OP_NEW_TABLE);
+    int entries = 0;
     do
     {
         // Stop if we hit the end of the list.
         if (check(TOKEN_RIGHT_BRACE)) 
         {
             consume(TOKEN_RIGHT_BRACE,"");
+            patchItemCount(sizeOffset, entries);
             return;
         }
 
@@ -712,14 +785,21 @@ static void hashTable(bool canAssign)
         consume(TOKEN_COLON, "Missing ':'");
         expression();
         emitByte(OP_TABLE_ADD);
+        entries++;
     } while (match(TOKEN_COMMA));
     
     consume(TOKEN_RIGHT_BRACE,"Expect '}'");
+    patchItemCount(sizeOffset, entries);
 }
 
 static void list(bool canAssign)
 {
-    emitByte(OP_NEW_LIST);
+    int start = currentChunk()->count;
+    int items = 0;
+    int adds = 0;
+    bool isRange = false;
+    int sizeOffset = emitNewCollection(OP_NEW_LIST);
+    int itemsStart = currentChunk()->count;
  
     do
     {
@@ -727,25 +807,39 @@ static void list(bool canAssign)
         if (check(TOKEN_RIGHT_BRACKET)) 
         {
             consume(TOKEN_RIGHT_BRACKET,"");
+            patchItemCount(sizeOffset, adds);
             return;
         }
 
         // parameter 2 - value adding to the list
         expression();
+        items++;
 
         // .. so we're doing range
         if(match(TOKEN_DOT_DOT))
         {
             expression();
             emitByte(OP_RANGE);
+            isRange = true;
         }
         else
         {
             emitByte(OP_LIST_ADD);
+            isRange = false;
+            adds++;
         }
     } while (match(TOKEN_COMMA));
     
     consume(TOKEN_RIGHT_BRACKET,"Expect ']'");
+    patchItemCount(sizeOffset, adds);
+
+    if (items == 1 && isRange)
+    {
+        lastRange.chunk = currentChunk();
+        lastRange.start = start;
+        lastRange.end = currentChunk()->count;
+        lastRange.items = itemsStart;
+    }
 }
 
 static void subscript(bool canAssign)
@@ -808,17 +902,23 @@ static void sql(bool canAssign)
 {
     // emit function 
     char* fnName = "query";
-    int arg = stringConstant(fnName);
+    int arg = globalSlotFor(fnName, (int)strlen(fnName));
+    int start = currentChunk()->count;
     emitBytes16(OP_GET_GLOBAL, (uint16_t)arg);
     string(false);
     emitBytes(OP_CALL, 1);
+
+    lastSql.chunk = currentChunk();
+    lastSql.start = start;
+    lastSql.end = currentChunk()->count;
 }
 
 static void sqlParam(bool canAssign)
 {
     // emit function 
     char* fnName = "query";
-    int arg = stringConstant(fnName);
+    int arg = globalSlotFor(fnName, (int)strlen(fnName));
+    int start = currentChunk()->count;
     emitBytes16(OP_GET_GLOBAL, (uint16_t)arg);
 
     int params = 1;
@@ -843,6 +943,10 @@ static void sqlParam(bool canAssign)
     string(false);
 
     emitBytes(OP_CALL, params);
+
+    lastSql.chunk = currentChunk();
+    lastSql.start = start;
+    lastSql.end = currentChunk()->count;
 }
 
 
@@ -858,7 +962,8 @@ static void sqlParam(bool canAssign)
 static void interpolation(bool canAssign)
 {
     // Create a new list
-    emitByte(OP_NEW_LIST);  
+    int sizeOffset = emitNewCollection(OP_NEW_LIST);
+    int parts = 1;
 
     do
     {
@@ -875,8 +980,10 @@ static void interpolation(bool canAssign)
             emitByte(OP_FORMAT);
         }
         emitByte(OP_LIST_ADD);
+        parts += 2;
 
     } while (match(TOKEN_INTERPOLATION));
+    patchItemCount(sizeOffset, parts);
 
     
     
@@ -1121,7 +1228,7 @@ static uint16_t parseVariable(const char* errorMessage, bool isConst)
     if (!isConst)
         errorAtCurrent("Global variables must be marked 'const'");
 
-    return identifierConstant(&parser.previous);
+    return identifierGlobal(&parser.previous);
 }
 
 static void function(FunctionType type) 
@@ -1203,7 +1310,7 @@ static void enumDeclaration()
 
     declareVariable(false);
     emitBytes16(OP_ENUM, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&enumName));
     namedVariable(enumName, false);
     consume(TOKEN_LEFT_BRACE, "Expect '{' before enum body.");
     initTable(&dupeCheck);
@@ -1212,7 +1319,7 @@ static void enumDeclaration()
     {
         consume(TOKEN_IDENTIFIER, "Expect enum name.");
         uint16_t fieldConstant = identifierConstant(&parser.previous);
-        ObjString* fieldName = copyStringRaw(parser.previous.start, parser.previous.length);
+        ObjString* fieldName = internString(copyStringRaw(parser.previous.start, parser.previous.length));
         if (tableGet(&dupeCheck, fieldName, &dummyVal))
         {
             error("Duplicate enum field");
@@ -1263,7 +1370,7 @@ static void classDeclaration()
     declareVariable(false);
 
     emitBytes16(OP_CLASS, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&className));
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -1290,7 +1397,7 @@ static void modDeclaration()
     declareVariable(false);
 
     emitBytes16(OP_MODULE, nameConstant);
-    defineVariable(nameConstant);
+    defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&modName));
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -1316,6 +1423,15 @@ static void funDeclaration()
     defineVariable(global);
 }
 
+static void removeCode(int offset, int length)
+{
+    Chunk* chunk = currentChunk();
+    int tail = chunk->count - offset - length;
+    memmove(chunk->code + offset, chunk->code + offset + length, tail);
+    memmove(chunk->lines + offset, chunk->lines + offset + length, tail * sizeof(int));
+    chunk->count -= length;
+}
+
 static void loopVarDeclaration(char* name) 
 {
     // this does what parse variable does
@@ -1366,59 +1482,60 @@ static void forStatement()
     uint8_t counter = current->localCount - 1;
 
     loopVarDeclaration("~enumerable");
-    uint8_t list = current->localCount - 1;
   
     uint16_t global = parseVariable("Expect variable name.", false);
+    int counterStart = currentChunk()->count;
     emitConstant(NUMBER_VAL(0));
     defineVariable(global);
-    uint8_t var = current->localCount - 1;
 
     consume(TOKEN_IN,"missing in");
 
+    // the enumerable and the loop variable follow the counter on the stack
+    int iterableStart = currentChunk()->count;
     expression();
-    emitBytes(OP_SET_LOCAL, list);
+
+    uint8_t iterOp = OP_FOR_ITER;
+    if (lastRange.chunk == currentChunk() && lastRange.start == iterableStart
+        && lastRange.end == currentChunk()->count)
+    {
+        // for x in [a..b]: drop the counter constant, OP_NEW_LIST and OP_RANGE
+        // so a and b become the counter and the bound, and no list is built
+        removeCode(lastRange.end - 1, 1);
+        removeCode(counterStart, lastRange.items - counterStart);
+        emitByte(OP_RANGE_BOUND);
+        iterOp = OP_FOR_RANGE;
+    }
+    else if (lastSql.chunk == currentChunk() && lastSql.start == iterableStart
+        && lastSql.end == currentChunk()->count)
+    {
+        // for x in $"select ...": call ~cursor instead of query so the rows
+        // are read as the loop goes
+        int slot = globalSlotFor("~cursor", 7);
+        currentChunk()->code[lastSql.start + 1] = (slot >> 8) & 0xff;
+        currentChunk()->code[lastSql.start + 2] = slot & 0xff;
+    }
+    if (iterOp == OP_FOR_ITER)
+        current->iterators[current->iteratorCount++] = counter + 1;
+    lastRange.chunk = NULL;
+    lastSql.chunk = NULL;
+    emitByte(OP_NIL);
     
     //loop starts here
     int loopStart = currentChunk()->count;
 
-    // jump over
-    emitBytes(OP_GET_LOCAL, counter);
-    
-    // ** Call to get length of list/string **
-    // Get function name
-    char* fnName = "len";
-    int arg = stringConstant(fnName);
-    emitBytes16(OP_GET_GLOBAL, (uint16_t)arg);
-
-    // parameter 1 - the list or string we're getting the length of
-    emitBytes(OP_GET_LOCAL, list);
-
-    // call the function
-    emitBytes(OP_CALL, 1);
-    // end len
-
-    emitByte(OP_LESS);     
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-
-    emitBytes(OP_GET_LOCAL, list);
-    emitBytes(OP_GET_LOCAL, counter);
-    emitByte(OP_SUBSCRIPT);
-    emitBytes(OP_SET_LOCAL, var);
+    // OP_FOR_ITER / OP_FOR_RANGE store the next element in the loop variable
+    // and advance the counter, or jump out once the enumerable is exhausted
+    emitBytes(iterOp, counter);
+    emitByte(0xff);
+    emitByte(0xff);
+    int exitJump = currentChunk()->count - 2;
     
     statement();
 
-    //Now increase i by 1
-    emitBytes(OP_GET_LOCAL, counter);
-    emitConstant(NUMBER_VAL(1));
-    emitByte(OP_ADD);
-    emitBytes(OP_SET_LOCAL, counter); 
-    emitByte(OP_POP);
-    emitByte(OP_POP); 
-
     emitLoop(loopStart);
 
     patchJump(exitJump);
+    if (iterOp == OP_FOR_ITER) current->iteratorCount--;
     endScope();
 }
 
@@ -1449,6 +1566,13 @@ static void printStatement()
     emitByte(OP_PRINT);
 }
 
+// Loops that run to the end close their iterator themselves.
+static void closeIterators()
+{
+    for (int i = current->iteratorCount - 1; i >= 0; i--)
+        emitBytes(OP_CLOSE_ITER, current->iterators[i]);
+}
+
 static void returnStatement() 
 {
     if (current->type == TYPE_SCRIPT) 
@@ -1459,6 +1583,7 @@ static void returnStatement()
     //if (match(TOKEN_SEMICOLON)) 
     if (isReturnAtEndOfBlock())
     {
+        closeIterators();
         emitReturn();
     } 
     else 
@@ -1468,6 +1593,7 @@ static void returnStatement()
     
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        closeIterators();
         emitByte(OP_RETURN);
     }
 }
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) 
 {
@@ -30,6 +31,14 @@ static int byteInstruction(const char* name, Chunk* chunk,
     return offset + 2; 
 }
 
+static int shortInstruction(const char* name, Chunk* chunk,
+                            int offset) 
+{
+    uint16_t value = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, value);
+    return offset + 3; 
+}
+
 static int jumpInstruction(const char* name, int sign,
                            Chunk* chunk, int offset) 
 {
@@ -42,6 +51,14 @@ static int jumpInstruction(const char* name, int sign,
     return offset + 3;
 }
 
+static int forInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 4 + jump);
+    return offset + 4;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk,
                                int offset) 
 {
@@ -53,15 +70,37 @@ static int constantInstruction(const char* name, Chunk* chunk,
     return offset + 3;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk,
+                             int offset) 
+{
+    uint16_t slot = (uint16_t)((chunk->code[offset+1] << 8) | chunk->code[offset+2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk,
                                 int offset) 
 {
     uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
     uint8_t argCount = chunk->code[offset + 3];
+    uint16_t cache = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 4;
+    printf("' cache %d\n", cache);
+    return offset + 6;
+}
+
+static int propertyInstruction(const char* name, Chunk* chunk,
+                               int offset) 
+{
+    uint16_t constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    uint16_t cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' cache %d\n", cache);
+    return offset + 5;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) 
@@ -114,9 +153,9 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SUBSCRIPT:
             return simpleInstruction("OP_SUBSCRIPT", offset);
         case OP_LIST_ADD:
@@ -130,7 +169,7 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_POP_LIST:
             return simpleInstruction("OP_POP_LIST", offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
@@ -156,9 +195,9 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_NEW_LIST:
-            return simpleInstruction("OP_NEW_LIST", offset);
+            return shortInstruction("OP_NEW_LIST", chunk, offset);
         case OP_NEW_TABLE:
-            return simpleInstruction("OP_NEW_TABLE", offset);
+            return shortInstruction("OP_NEW_TABLE", chunk, offset);
         case OP_TABLE_ADD:
             return simpleInstruction("OP_TABLE_ADD", offset);
         case OP_JUMP:
@@ -167,6 +206,14 @@ int disassembleInstruction(Chunk* chunk, int offset)
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_FOR_ITER:
+            return forInstruction("OP_FOR_ITER", chunk, offset);
+        case OP_RANGE_BOUND:
+            return simpleInstruction("OP_RANGE_BOUND", offset);
+        case OP_FOR_RANGE:
+            return forInstruction("OP_FOR_RANGE", chunk, offset);
+        case OP_CLOSE_ITER:
+            return byteInstruction("OP_CLOSE_ITER", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
         case OP_CLASS:
@@ -174,9 +221,9 @@ int disassembleInstruction(Chunk* chunk, int offset)
         case OP_MODULE:
             return constantInstruction("OP_MODULE", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_INC_PROPERTY:
             return constantInstruction("OP_INC_PROPERTY", chunk, offset);
         case OP_ADD_PROPERTY:
@@ -22,6 +22,7 @@
 char *includeFiles[MAX_INCS];
 char *fileContents[MAX_INCS];
 char *fileContentsName[MAX_INCS];
+char *fileContentsPath[MAX_INCS];
 
 int includeFileCount = 0;
 int fileContentsCount = 0;
@@ -190,6 +191,8 @@ static bool preProcessFile(const char *filename, const char *rootFilename)
     fileContents[fileContentsCount] = buffer;
     fileContentsName[fileContentsCount] = (char *)malloc(strlen(filename) + 1);
     memcpy(fileContentsName[fileContentsCount], filename, strlen(filename) + 1);
+    fileContentsPath[fileContentsCount] = (char *)malloc(strlen(adjustedFilename) + 1);
+    memcpy(fileContentsPath[fileContentsCount], adjustedFilename, strlen(adjustedFilename) + 1);
     fileContentsCount++;
 
     return true;
@@ -202,7 +205,7 @@ static int runFile(const char *path)
     for (int i = 0; i < fileContentsCount; i++)
     {
         // printf("Running file %d of %d: %s\n", i+1, fileContentsCount, fileContentsName[i]);
-        InterpretResult result = interpret(fileContents[i], fileContentsName[i]);
+        InterpretResult result = interpretFile(fileContents[i], fileContentsName[i], fileContentsPath[i]);
 
         if (result == INTERPRET_COMPILE_ERROR)
             return 65;
@@ -214,6 +217,7 @@ static int runFile(const char *path)
     {
         free(fileContents[i]);
         free(fileContentsName[i]);
+        free(fileContentsPath[i]);
     }
 
     return 0;
@@ -1,8 +1,10 @@
 #include <stdlib.h>
+#include <time.h>
 
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "sqlite3/sql.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -11,17 +13,23 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// Bytes allocated between minor collections. Objects that survive one are
+// promoted to the old generation and only looked at again by a full collection.
+#define NURSERY_SIZE (1024 * 1024)
+
+// Bytes allocated between steps of an incremental collection.
+#define GC_STEP_SIZE (64 * 1024)
+
+static void collectIfNeeded(size_t growth);
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
     vm.bytesAllocated += newSize - oldSize;
 
     if (newSize > oldSize) 
     {
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
-#endif
-        if (vm.bytesAllocated > vm.nextGC) 
-            collectGarbage();
+        vm.nurseryBytes += newSize - oldSize;
+        collectIfNeeded(newSize - oldSize);
     }
 
     if(newSize == 0)
@@ -40,7 +48,7 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 void markObject(Obj* object)
 {
     if (object == NULL) return;
-    if (object->isMarked) return;
+    if (IS_MARKED(object)) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -48,7 +56,7 @@ void markObject(Obj* object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    object->mark = vm.markBit;
 
     if (vm.grayCapacity < vm.grayCount + 1) 
     {
@@ -65,12 +73,54 @@ void markValue(Value value)
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
+// Keeps a young object alive through the next minor collection because an
+// old object refers to it. Remembering the young side rather than the old
+// one means a big old list doesn't get rescanned every time it's appended to.
+static void rememberObject(Obj* object)
+{
+    if (object->isRemembered) return;
+
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// Called by WRITE_BARRIER when a marked object is given an unmarked one.
+// Outside a full collection that means old pointing at young. While marking
+// it means a traced object pointing at an untraced one, which has to be
+// grayed or it would be missed.
+void writeBarrier(Obj* object)
+{
+    if (vm.gcState == GC_MARKING)
+        markObject(object);
+    else
+        rememberObject(object);
+}
+
 static void markArray(ValueArray* array) 
 {
     for (int i = 0; i < array->count; i++) 
         markValue(array->values[i]); 
 }
 
+static void markShape(Shape* shape)
+{
+    if (shape == NULL) return;
+
+    for (int i = 0; i < shape->count; i++)
+        markObject((Obj*)shape->names[i]);
+
+    for (int i = 0; i < shape->transitionCount; i++)
+        markShape(shape->transitions[i].shape);
+}
+
 static void blackenObject(Obj* object) 
 {
 #ifdef DEBUG_LOG_GC
@@ -95,6 +145,14 @@ static void blackenObject(Obj* object)
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->cacheCount; i++)
+            {
+                for (int j = 0; j < INLINE_CACHE_ENTRIES; j++)
+                {
+                    markObject((Obj*)function->caches[i].entries[j].klass);
+                    markValue(function->caches[i].entries[j].method);
+                }
+            }
             break;
         }
         case OBJ_LIST:
@@ -106,8 +164,8 @@ static void blackenObject(Obj* object)
         case OBJ_TABLE:
         {
             ObjTable* tbl = (ObjTable*)object;
-            markTable(&tbl->elements);
             markArray(&tbl->keys);
+            markArray(&tbl->values);
             break;
         }
         case OBJ_CLASS: 
@@ -115,12 +173,18 @@ static void blackenObject(Obj* object)
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            markShape(klass->shape);
             break;
         }
         case OBJ_INSTANCE: 
         {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
+            if (instance->shape != NULL)
+            {
+                for (int i = 0; i < instance->shape->count; i++)
+                    markValue(instance->slots[i]);
+            }
             markTable(&instance->fields);
             break;
         }
@@ -137,11 +201,27 @@ static void blackenObject(Obj* object)
             markObject((Obj*)bound->method);
             break;
         }
+        case OBJ_CURSOR:
+        {
+            ObjCursor* cursor = (ObjCursor*)object;
+            markObject((Obj*)cursor->names);
+            markObject((Obj*)cursor->row);
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(((ObjUpvalue*)object)->closed);
             break;
-        case OBJ_NATIVE:
         case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            if (string->isRope)
+            {
+                markObject((Obj*)((ObjRope*)string)->left);
+                markObject((Obj*)((ObjRope*)string)->right);
+            }
+            break;
+        }
+        case OBJ_NATIVE:
         break;
     }
 }
@@ -157,14 +237,23 @@ static void freeObject(Obj* object)
         case OBJ_STRING: 
         {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            if (string->isRope)
+            {
+                if (string->chars != NULL)
+                    FREE_ARRAY(char, string->chars, string->length + 1);
+                FREE(ObjRope, object);
+            }
+            else
+            {
+                reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            }
             break;
         }
         case OBJ_FUNCTION: 
         {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
+            FREE_ARRAY(InlineCache, function->caches, function->cacheCount);
             FREE(ObjFunction, object);
             break;
         }
@@ -178,8 +267,9 @@ static void freeObject(Obj* object)
         case OBJ_TABLE:
         {
             ObjTable* tbl = (ObjTable*)object;
-            freeTable(&tbl->elements);
             freeValueArray(&tbl->keys);
+            freeValueArray(&tbl->values);
+            FREE_ARRAY(int, tbl->index, tbl->indexCapacity);
             FREE(ObjTable, object);
             break;
         }
@@ -200,6 +290,7 @@ static void freeObject(Obj* object)
         {
             ObjClass* klass = (ObjClass*)object;
             freeTable(&klass->methods);
+            if (klass->shape != NULL) freeShape(klass->shape);
             FREE(ObjClass, object);
             break;
         } 
@@ -207,7 +298,9 @@ static void freeObject(Obj* object)
         {
             ObjInstance* instance = (ObjInstance*)object;
             freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            if (instance->slots != instance->inlineSlots)
+                FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+            reallocate(object, sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity, 0);
             break;
         }
         case OBJ_ENUM: 
@@ -220,20 +313,29 @@ static void freeObject(Obj* object)
         case OBJ_BOUND_METHOD:
             FREE(ObjBoundMethod, object);
             break;
+        case OBJ_CURSOR:
+            closeCursor((ObjCursor*)object);
+            FREE(ObjCursor, object);
+            break;
     }
 }
 
-void freeObjects() 
+static void freeList(Obj* object)
 {
-    Obj* object = vm.objects;
-    
     while (object != NULL) 
     {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() 
+{
+    freeList(vm.objects);
+    freeList(vm.oldObjects);
     free(vm.grayStack);
+    free(vm.remembered);
 }
 
 static void markRoots() 
@@ -253,11 +355,13 @@ static void markRoots()
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
-    markObject((Obj*)vm.whereString);
-    markObject((Obj*)vm.selectString);
+    for (int i = 0; i < UINT8_COUNT; i++)
+        markObject((Obj*)vm.charStrings[i]);
 }
 
 static void traceReferences() 
@@ -269,51 +373,244 @@ static void traceReferences()
     }
 }
 
-static void sweep() 
+// Frees unreached young objects and promotes the rest.
+static void sweepYoung() 
 {
-    Obj* previous = NULL;
     Obj* object = vm.objects;
 
     while (object != NULL) 
     {
-        if (object->isMarked) 
+        Obj* next = object->next;
+        if (IS_MARKED(object)) 
         {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+            object->next = vm.oldObjects;
+            vm.oldObjects = object;
         } 
         else 
         {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) 
-                previous->next = object;
-            else 
-                vm.objects = object;
-
-            freeObject(unreached);
+            freeObject(object);
         }
+        object = next;
     }
+
+    vm.objects = NULL;
+    vm.nurseryBytes = 0;
 }
 
-void collectGarbage()
+// Every young survivor is about to be promoted, so no old object will point
+// at a young one afterwards.
+static void forgetRemembered()
+{
+    for (int i = 0; i < vm.rememberedCount; i++)
+        vm.remembered[i]->isRemembered = false;
+
+    vm.rememberedCount = 0;
+}
+
+static void recordPause(clock_t start)
+{
+    clock_t pause = clock() - start;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
+}
+
+// Incremental work checks the clock every so many objects. A deadline of 0
+// means run to completion.
+static bool outOfTime(clock_t deadline, int work)
+{
+    return deadline != 0 && (work & 63) == 0 && clock() >= deadline;
+}
+
+// The intern table only needs checking for strings that can be freed, and
+// in a minor collection those are all young.
+static void removeYoungStrings()
+{
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+    {
+        if (object->type == OBJ_STRING && !IS_MARKED(object) &&
+            ((ObjString*)object)->isInterned)
+            tableDelete(&vm.strings, (ObjString*)object);
+    }
+}
+
+// Collects the young generation only. Old objects are already marked, so
+// tracing stops at them, and young objects stored into old ones by the write
+// barrier are extra roots.
+void collectNursery()
 {
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- minor gc begin\n");
     size_t before = vm.bytesAllocated;
 #endif
+    clock_t start = clock();
+
+    markRoots();
+    for (int i = 0; i < vm.rememberedCount; i++)
+        markObject(vm.remembered[i]);
+    traceReferences();
+    removeYoungStrings();
+    forgetRemembered();
+    sweepYoung();
+
+    vm.gcMinorCount++;
+    recordPause(start);
+
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+// Starts a full collection. Flipping the meaning of the mark bit unmarks
+// every old object at once; only the young ones, unmarked under the old
+// meaning, have to be touched.
+static void startCollection()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    vm.markBit = !vm.markBit;
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+        object->mark = !vm.markBit;
+
+    forgetRemembered();
+    markRoots();
+    vm.gcState = GC_MARKING;
+}
 
+// Once the gray stack runs dry the roots are marked again, since the stack
+// and globals change without a barrier, and everything they lead to is
+// traced in one go. The young objects then join the old ones, marked ones
+// are promoted that way, and the lot is swept in steps.
+static void finishMarking()
+{
     markRoots();
     traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
 
+    if (vm.objects != NULL)
+    {
+        Obj* last = vm.objects;
+        while (last->next != NULL) last = last->next;
+        last->next = vm.oldObjects;
+        vm.oldObjects = vm.objects;
+        vm.objects = NULL;
+    }
+    vm.nurseryBytes = 0;
+
+    vm.sweepLink = &vm.oldObjects;
+    vm.gcState = GC_SWEEPING;
+}
+
+static void markSome(clock_t deadline)
+{
+    int work = 0;
+    while (vm.grayCount > 0)
+    {
+        blackenObject(vm.grayStack[--vm.grayCount]);
+        if (outOfTime(deadline, ++work)) return;
+    }
+
+    finishMarking();
+}
+
+static void sweepSome(clock_t deadline)
+{
+    int work = 0;
+    while (*vm.sweepLink != NULL)
+    {
+        Obj* object = *vm.sweepLink;
+        if (IS_MARKED(object))
+        {
+            vm.sweepLink = &object->next;
+        }
+        else
+        {
+            *vm.sweepLink = object->next;
+            if (object->type == OBJ_STRING && ((ObjString*)object)->isInterned)
+                tableDelete(&vm.strings, (ObjString*)object);
+            freeObject(object);
+        }
+        if (outOfTime(deadline, ++work)) return;
+    }
+
+    vm.gcState = GC_IDLE;
+    vm.gcCount++;
     vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < NURSERY_SIZE) vm.nextGC = NURSERY_SIZE;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated,
-         vm.nextGC);
+    printf("   heap %zu bytes, next at %zu\n", vm.bytesAllocated, vm.nextGC);
 #endif
-}
\ No newline at end of file
+}
+
+// Does one budget's worth of an incremental collection, starting one if the
+// heap has grown enough.
+static void collectStep()
+{
+    clock_t start = clock();
+    clock_t deadline = start + vm.gcBudget;
+
+    if (vm.gcState == GC_IDLE)
+        startCollection();
+    else if (vm.gcState == GC_MARKING)
+        markSome(deadline);
+    else
+        sweepSome(deadline);
+
+    vm.stepBytes = 0;
+    recordPause(start);
+}
+
+void collectGarbage()
+{
+    clock_t start = clock();
+
+    if (vm.gcState == GC_IDLE)
+        startCollection();
+    if (vm.gcState == GC_MARKING)
+        markSome(0);
+    sweepSome(0);
+
+    recordPause(start);
+}
+
+// Bytes held by objects that have survived a collection. Full collections
+// are paced by this growing, so garbage that dies young only ever costs
+// minor ones.
+static size_t oldBytes()
+{
+    return vm.bytesAllocated > vm.nurseryBytes ? vm.bytesAllocated - vm.nurseryBytes : 0;
+}
+
+// Called from the allocator. Between full collections the nursery decides
+// when to collect; once an incremental collection has started, minor ones
+// wait for it to finish and it advances every GC_STEP_SIZE bytes instead.
+static void collectIfNeeded(size_t growth)
+{
+#ifdef DEBUG_STRESS_GC
+    if (vm.gcState == GC_IDLE)
+        collectNursery();
+    else
+        collectStep();
+#endif
+
+    if (vm.gcState != GC_IDLE)
+    {
+        vm.stepBytes += growth;
+        if (vm.stepBytes > GC_STEP_SIZE)
+            collectStep();
+    }
+    else if (oldBytes() > vm.nextGC)
+    {
+        if (vm.gcIncremental)
+            collectStep();
+        else
+            collectGarbage();
+    }
+    else if (vm.nurseryBytes > NURSERY_SIZE)
+    {
+        collectNursery();
+    }
+}
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -19,9 +20,24 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// What a set mark bit means flips with every full collection.
+#define IS_MARKED(object) ((object)->mark == vm.markBit)
+
+// Any store that can give an old object a reference to a young one must go
+// through the write barrier, or a minor collection will free the young object.
+// The same check catches a traced object being given an untraced one during
+// incremental marking.
+#define WRITE_BARRIER(owner, value) \
+    do { \
+        if (IS_OBJ(value) && IS_MARKED((Obj*)(owner)) && !IS_MARKED(AS_OBJ(value))) \
+            writeBarrier(AS_OBJ(value)); \
+    } while (false)
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void freeObjects();
 void collectGarbage();
+void collectNursery();
+void writeBarrier(Obj* object);
 void markValue(Value value);
 void markObject(Obj* object);
 
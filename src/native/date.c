@@ -18,7 +18,8 @@ bool nowNative(int argCount, Value* args)
 bool datepartsNative(int argCount, Value* args)
 {
     CHECK_DATE(0, "dateparts() expects a date");
-    struct tm * timeinfo = localtime(&AS_DATETIME(args[0]));
+    time_t t = AS_DATETIME(args[0]);
+    struct tm * timeinfo = localtime(&t);
 
     ObjList* list = newList();
     push(OBJ_VAL(list)); // stop list being garbage collected
@@ -162,7 +163,8 @@ bool dateaddNative(int argCount, Value* args)
     CHECK_STRING(1,"Argument 2 of dateadd() must be a string");
     CHECK_NUM(2,"Argument 3 of dateadd() must be a number");
 
-    struct tm * timeinfo = localtime(&AS_DATETIME(args[0]));
+    time_t t = AS_DATETIME(args[0]);
+    struct tm * timeinfo = localtime(&t);
     
     ObjString* interval = AS_STRING(args[1]);
     int number = (int)AS_NUMBER(args[2]);
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
@@ -11,6 +12,7 @@
 #include "native.h"
 
 #define BUFFER_SIZE 200
+#define READLINES_SAMPLE 64
 #define MAX_FILES 255
 
 static FILE* files[MAX_FILES];
@@ -134,6 +136,15 @@ bool readlinesNative(int argCount, Value* args)
     ObjList* list = newList();
     push(OBJ_VAL(list)); // stop list being garbage collected
 
+    // once a few lines are in, guess the total from how far through the
+    // file they got and size the list for that
+    long fileSize = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+    {
+        fileSize = ftell(file);
+        rewind(file);
+    }
+
     while (fgets(buffer, sizeof(buffer), file)) 
     {
         //printf("buffer: %s\n", buffer);
@@ -168,7 +179,18 @@ bool readlinesNative(int argCount, Value* args)
             Value val = OBJ_VAL(copyStringRaw(line, (int)strlen(line)));
             push(val);
             writeValueArray(&list->elements, val);
+            WRITE_BARRIER(list, val);
             pop();
+            if (list->elements.count == READLINES_SAMPLE && fileSize > 0)
+            {
+                long position = ftell(file);
+                if (position > 0 && position < fileSize)
+                {
+                    double estimate = (double)READLINES_SAMPLE * fileSize / position;
+                    if (estimate < INT_MAX / (int)sizeof(Value))
+                        reserveValueArray(&list->elements, (int)(estimate * 1.1));
+                }
+            }
             line[0] = '\0';
             buffCount = 0;
             //i++;
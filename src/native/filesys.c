@@ -6,6 +6,7 @@
 #include "../value.h"
 #include "../object.h"
 #include "../vm.h"
+#include "../memory.h"
 #include "tinydir.h"
 #include "filesys.h"
 #include "native.h"
@@ -62,6 +63,7 @@ bool runNative(int argCount, Value* args)
         Value val =OBJ_VAL(copyStringRaw(output, (int)strlen(output)));
         push(val);
         writeValueArray(&list->elements, val);
+        WRITE_BARRIER(list, val);
         pop();
     }
     
@@ -94,6 +96,7 @@ bool dirNative(int argCount, Value* args)
         Value val =OBJ_VAL(copyStringRaw(file.name, (int)strlen(file.name)));
         push(val);
         writeValueArray(&list->elements, val);
+        WRITE_BARRIER(list, val);
         pop();
         tinydir_next(&dir);
     }
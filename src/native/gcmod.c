@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../common.h"
+#include "../value.h"
+#include "../object.h"
+#include "../vm.h"
+#include "../memory.h"
+#include "native.h"
+
+#define TICKS_TO_MS(ticks) ((double)(ticks) * 1000.0 / CLOCKS_PER_SEC)
+
+bool collectNative(int argCount, Value* args)
+{
+    collectGarbage();
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// gc.incremental(true) spreads full collections over many short steps.
+bool incrementalNative(int argCount, Value* args)
+{
+    CHECK_BOOL(0, "incremental() expects true or false");
+
+    args[-1] = BOOL_VAL(vm.gcIncremental);
+    vm.gcIncremental = AS_BOOL(args[0]);
+    return true;
+}
+
+// Sets how many milliseconds an incremental step may run, returns the old value.
+bool budgetNative(int argCount, Value* args)
+{
+    CHECK_NUM(0, "budget() expects a number of milliseconds");
+
+    double ms = AS_NUMBER(args[0]);
+    if (ms <= 0)
+    {
+        NATIVE_ERROR("budget() must be greater than 0");
+    }
+
+    args[-1] = NUMBER_VAL(TICKS_TO_MS(vm.gcBudget));
+    vm.gcBudget = (clock_t)(ms * CLOCKS_PER_SEC / 1000.0);
+    if (vm.gcBudget < 1) vm.gcBudget = 1;
+    return true;
+}
+
+static void setStat(ObjTable* table, const char* name, Value value)
+{
+    push(OBJ_VAL(copyStringRaw(name, (int)strlen(name))));
+    setTable(OBJ_VAL(table), value, vm.stackTop[-1]);
+    pop();
+}
+
+bool statsNative(int argCount, Value* args)
+{
+    ObjTable* table = newTable();
+    push(OBJ_VAL(table));
+
+    setStat(table, "collections", NUMBER_VAL((double)vm.gcCount));
+    setStat(table, "minor", NUMBER_VAL((double)vm.gcMinorCount));
+    setStat(table, "maxpause", NUMBER_VAL(TICKS_TO_MS(vm.gcMaxPause)));
+    setStat(table, "heap", NUMBER_VAL((double)vm.bytesAllocated));
+    setStat(table, "incremental", BOOL_VAL(vm.gcIncremental));
+
+    args[-1] = OBJ_VAL(table);
+    pop();
+    return true;
+}
@@ -0,0 +1,9 @@
+#ifndef sm_gcmod_h
+#define sm_gcmod_h
+
+bool collectNative(int argCount, Value* args);
+bool incrementalNative(int argCount, Value* args);
+bool budgetNative(int argCount, Value* args);
+bool statsNative(int argCount, Value* args);
+
+#endif
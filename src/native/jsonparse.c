@@ -6,6 +6,7 @@
 #include "../value.h"
 #include "../object.h"
 #include "../vm.h"
+#include "../memory.h"
 #include "native.h"
 #include "jsmn.h"
 
@@ -96,6 +97,7 @@ bool addNodesToTable(Value table, char* json, jsmntok_t* tokens, bool children)
             ObjList* list = AS_LIST(table);
             //printf("add to array\n");
             writeValueArray(&list->elements, val);
+            WRITE_BARRIER(list, val);
         }
         else if (type == JSMN_OBJECT)
             setTable(table, val, key);
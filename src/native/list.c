@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
@@ -14,6 +16,7 @@ bool addNative(int argCount, Value* args)
 
     ObjList* list = AS_LIST(args[0]);
     writeValueArray(&list->elements, args[1]);
+    WRITE_BARRIER(list, args[1]);
     return true;
 }
 
@@ -29,16 +32,74 @@ bool lenNative(int argCount, Value* args)
 
     if (IS_STRING(args[0]))
     {
-        ObjString* string = AS_STRING(args[0]);
+        // a rope knows its length without being flattened
+        ObjString* string = (ObjString*)AS_OBJ(args[0]);
         args[-1] = NUMBER_VAL(string->length);
         
         return true;
     }
 
-    NATIVE_ERROR("len only available for strings and lists");
+    if (IS_TABLE(args[0]))
+    {
+        args[-1] = NUMBER_VAL(AS_TABLE(args[0])->count);
+        return true;
+    }
+
+    NATIVE_ERROR("len only available for strings, lists and tables");
     
 }
 
+// remove(table, key) deletes the key, returning false if it wasn't there.
+bool removeNative(int argCount, Value* args)
+{
+    if (!IS_TABLE(args[0]))
+    {
+        NATIVE_ERROR("remove expects a table as the first parameter.");
+    }
+    if (!IS_TABLE_KEY(args[1]))
+    {
+        NATIVE_ERROR("remove expects a string, number, date or bool key.");
+    }
+
+    Value key = args[1];
+    if (IS_STRING(key))
+    {
+        ObjString* interned = findInternedString(AS_STRING(key));
+        if (interned == NULL)
+        {
+            args[-1] = BOOL_VAL(false);
+            return true;
+        }
+        key = OBJ_VAL(interned);
+    }
+    args[-1] = BOOL_VAL(removeTableKey(AS_TABLE(args[0]), key));
+    return true;
+}
+
+// reserve(list or table, n) makes room for n items without growing again.
+bool reserveNative(int argCount, Value* args)
+{
+    CHECK_NUM(1, "reserve expects a number as the second parameter.");
+
+    double capacity = AS_NUMBER(args[1]);
+    if (capacity < 0 || capacity > INT_MAX / (int)sizeof(Value))
+    {
+        NATIVE_ERROR("reserve capacity is out of range.");
+    }
+
+    if (IS_LIST(args[0]))
+        reserveValueArray(&AS_LIST(args[0])->elements, (int)capacity);
+    else if (IS_TABLE(args[0]))
+        reserveTable(AS_TABLE(args[0]), (int)capacity);
+    else
+    {
+        NATIVE_ERROR("reserve expects a list or table as the first parameter.");
+    }
+
+    args[-1] = args[0];
+    return true;
+}
+
 bool rangeNative(int argCount, Value* args)
 {
     if (!IS_NUMBER(args[1]) || !IS_NUMBER(args[2]))
@@ -52,6 +113,7 @@ bool rangeNative(int argCount, Value* args)
     ObjList* list = AS_LIST(args[0]);
     push(OBJ_VAL(list));
 
+    reserveValueArray(&list->elements, list->elements.count + abs(end - start) + 1);
     for(int i = start; (start > end) ? i >= end : i <= end; (start > end) ? i-- : i++)
     {
         writeValueArray(&list->elements, NUMBER_VAL((double)i));
@@ -70,18 +132,15 @@ Value join(ObjList* list)
     for(int i=0; i < list->elements.count; i++)
         resultLength += stringifyValueLength(list->elements.values[i], false);
 
-    char* result = ALLOCATE(char, resultLength + 1); 
-    result[0] = '\0';
+    ObjString* result = allocateString(resultLength);
     int length = 0;
     for(int i=0; i < list->elements.count; i++)
     {
         Value val = list->elements.values[i];
-        length += stringifyValue(val, result + length, false);
+        length += stringifyValue(val, result->chars + length, false);
     }   
 
-    Value joined = OBJ_VAL(takeString(result, resultLength));
-
-    return joined;
+    return OBJ_VAL(result);
 }
 
 bool joinNative(int argCount, Value* args)
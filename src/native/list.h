@@ -7,6 +7,8 @@
 
 bool addNative(int argCount, Value* args);
 bool lenNative(int argCount, Value* args);
+bool removeNative(int argCount, Value* args);
+bool reserveNative(int argCount, Value* args);
 bool rangeNative(int argCount, Value* args);
 bool joinNative(int argCount, Value* args);
 Value join(ObjList* list);
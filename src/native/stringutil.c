@@ -43,6 +43,7 @@ bool splitlinesNative(int argCount, Value* args)
                 Value val =OBJ_VAL(copyStringRaw(item, i-start));
                 push(val);
                 writeValueArray(&list->elements, val);
+                WRITE_BARRIER(list, val);
                 pop();
             }
 			start = i + 1;
@@ -61,6 +62,7 @@ bool splitlinesNative(int argCount, Value* args)
         Value val =OBJ_VAL(copyStringRaw(item, end-start));
         push(val);
         writeValueArray(&list->elements, val);
+        WRITE_BARRIER(list, val);
         pop();
     }
     args[-1] = OBJ_VAL(list);
@@ -106,6 +108,7 @@ bool splitNative(int argCount, Value* args)
                 Value val = OBJ_VAL(copyStringRaw(item, i-start ));
                 push(val);
                 writeValueArray(&list->elements, val);
+                WRITE_BARRIER(list, val);
                 pop();
             }
             i += (len-1);
@@ -128,6 +131,7 @@ bool splitNative(int argCount, Value* args)
         Value val =OBJ_VAL(copyStringRaw(item, end-start));
         push(val);
         writeValueArray(&list->elements, val);
+        WRITE_BARRIER(list, val);
         pop();
     }
     args[-1] = OBJ_VAL(list);
@@ -162,10 +166,7 @@ bool charNative(int argCount, Value* args)
     {
         NATIVE_ERROR("char expect a number between 0 and 255");
     }
-    char c[1];
-    c[0] = val;
-    //c[1] = '\0';
-    args[-1] = OBJ_VAL(copyStringRaw(c, 1));
+    args[-1] = OBJ_VAL(CHAR_STRING(val));
 
     return true;
 }
@@ -175,13 +176,12 @@ bool upperNative(int argCount, Value* args)
     CHECK_STRING(0, "ascii expects a string as parameter.");
     
     ObjString* string = AS_STRING(args[0]);
-    char *result = ALLOCATE(char, string->length+1);
+    ObjString* result = allocateString(string->length);
 
     for (int i=0; i<string->length; i++)
-        result[i] = toupper(string->chars[i]);
-    result[string->length] = '\0';
+        result->chars[i] = toupper(string->chars[i]);
 
-    args[-1] = OBJ_VAL(takeString(result, string->length));
+    args[-1] = OBJ_VAL(result);
     
     return true;
 }
@@ -16,7 +16,8 @@ static Obj* allocateObject(size_t size, ObjType type)
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     object->next = vm.objects;
-    object->isMarked = false;
+    object->mark = !vm.markBit;
+    object->isRemembered = false;
     vm.objects = object;
 
 #ifdef DEBUG_LOG_GC
@@ -58,18 +59,170 @@ ObjFunction* newFunction()
     function->upvalueCount = 0;
     function->optionals = 0;
     function->name = NULL;
+    function->cacheCount = 0;
+    function->caches = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) 
 {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int capacity = klass->slotHint;
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
     instance->klass = klass;
+    instance->shape = klass->shape;
     initTable(&instance->fields);
+    instance->slotCapacity = capacity;
+    instance->inlineCapacity = capacity;
+    instance->slots = instance->inlineSlots;
     return instance;
 }
 
+static Shape* newShape(Shape* parent, ObjString* name)
+{
+    int count = parent == NULL ? 0 : parent->count + 1;
+    ObjString** names = ALLOCATE(ObjString*, count);
+    if (parent != NULL)
+    {
+        if (parent->count > 0)
+            memcpy(names, parent->names, sizeof(ObjString*) * parent->count);
+        names[parent->count] = name;
+    }
+
+    Shape* shape = ALLOCATE(Shape, 1);
+    shape->count = count;
+    shape->names = names;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    shape->transitions = NULL;
+    return shape;
+}
+
+void freeShape(Shape* shape)
+{
+    for (int i = 0; i < shape->transitionCount; i++)
+        freeShape(shape->transitions[i].shape);
+
+    FREE_ARRAY(ShapeTransition, shape->transitions, shape->transitionCapacity);
+    FREE_ARRAY(ObjString*, shape->names, shape->count);
+    FREE(Shape, shape);
+}
+
+int shapeSlot(Shape* shape, ObjString* name)
+{
+    for (int i = 0; i < shape->count; i++)
+    {
+        if (shape->names[i] == name) return i;
+    }
+    return -1;
+}
+
+// The shape reached by adding name, or NULL when that would exceed
+// MAX_SHAPE_FIELDS. Transitions are created once and shared.
+Shape* shapeTransition(Shape* shape, ObjString* name)
+{
+    for (int i = 0; i < shape->transitionCount; i++)
+    {
+        if (shape->transitions[i].name == name) return shape->transitions[i].shape;
+    }
+
+    if (shape->count >= MAX_SHAPE_FIELDS) return NULL;
+
+    Shape* next = newShape(shape, name);
+    if (shape->transitionCapacity < shape->transitionCount + 1)
+    {
+        int oldCapacity = shape->transitionCapacity;
+        shape->transitionCapacity = GROW_CAPACITY(oldCapacity);
+        shape->transitions = GROW_ARRAY(ShapeTransition, shape->transitions,
+                                        oldCapacity, shape->transitionCapacity);
+    }
+    shape->transitions[shape->transitionCount].name = name;
+    shape->transitions[shape->transitionCount].shape = next;
+    shape->transitionCount++;
+    return next;
+}
+
+bool getField(ObjInstance* instance, ObjString* name, Value* value)
+{
+    if (instance->shape == NULL)
+        return tableGet(&instance->fields, name, value);
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot == -1) return false;
+
+    *value = instance->slots[slot];
+    return true;
+}
+
+// Moves an instance that has run out of shape slots into its field table.
+static void convertToFields(ObjInstance* instance)
+{
+    Shape* shape = instance->shape;
+    for (int i = 0; i < shape->count; i++)
+        tableSet(&instance->fields, shape->names[i], instance->slots[i]);
+
+    instance->shape = NULL;
+    if (instance->slots != instance->inlineSlots)
+        FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    instance->slots = instance->inlineSlots;
+    instance->slotCapacity = instance->inlineCapacity;
+}
+
+// Stores value in slot after moving the instance to shape, growing the slot
+// storage when shape has more fields than fit.
+void setFieldSlot(ObjInstance* instance, Shape* shape, int slot, Value value)
+{
+    if (slot >= instance->slotCapacity)
+    {
+        int capacity = GROW_CAPACITY(instance->slotCapacity);
+        Value* slots = ALLOCATE(Value, capacity);
+        memcpy(slots, instance->slots, sizeof(Value) * instance->shape->count);
+        if (instance->slots != instance->inlineSlots)
+            FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+        instance->slots = slots;
+        instance->slotCapacity = capacity;
+    }
+
+    instance->slots[slot] = value;
+    instance->shape = shape;
+    WRITE_BARRIER(instance, value);
+
+    if (shape->count > instance->klass->slotHint)
+        instance->klass->slotHint = shape->count;
+}
+
+// Returns true if the field is new to the instance.
+bool setField(ObjInstance* instance, ObjString* name, Value value)
+{
+    if (instance->shape != NULL)
+    {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot != -1)
+        {
+            instance->slots[slot] = value;
+            WRITE_BARRIER(instance, value);
+            return false;
+        }
+
+        Shape* next = shapeTransition(instance->shape, name);
+        if (next != NULL)
+        {
+            // the new shape holds the name for the class
+            WRITE_BARRIER(instance->klass, OBJ_VAL(name));
+            setFieldSlot(instance, next, next->count - 1, value);
+            return true;
+        }
+
+        convertToFields(instance);
+    }
+
+    bool isNew = tableSet(&instance->fields, name, value);
+    WRITE_BARRIER(instance, OBJ_VAL(name));
+    WRITE_BARRIER(instance, value);
+    return isNew;
+}
+
 ObjNative* newNative(NativeFn function, int arity) 
 {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
@@ -79,11 +232,17 @@ ObjNative* newNative(NativeFn function, int arity)
 }
 
 ObjList* newList()
+{
+    return newListWithCapacity(0);
+}
+
+ObjList* newListWithCapacity(int capacity)
 {
     // Allocate this before the list object in case it triggers a GC which would
     // free the list.
     ValueArray elements;
     initValueArray(&elements);
+    reserveValueArray(&elements, capacity);
     
     ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
     list->elements = elements;
@@ -93,24 +252,250 @@ ObjList* newList()
 
 ObjTable* newTable()
 {
-    Table elements;
-    initTable(&elements);
     ObjTable* table = ALLOCATE_OBJ(ObjTable, OBJ_TABLE);
-    table->elements = elements;
-
-    ValueArray keys;
-    initValueArray(&keys);
-    table->keys = keys;
+    initValueArray(&table->keys);
+    initValueArray(&table->values);
+    table->count = 0;
+    table->index = NULL;
+    table->indexCapacity = 0;
+    table->indexUsed = 0;
+    table->iterators = 0;
     
     return table;
 }
 
+ObjTable* newTableWithCapacity(int capacity)
+{
+    ObjTable* table = newTable();
+    if (capacity > 0)
+    {
+        push(OBJ_VAL(table));
+        reserveTable(table, capacity);
+        pop();
+    }
+    return table;
+}
+
+#define TABLE_SLOT_EMPTY   -1
+#define TABLE_SLOT_REMOVED -2
+#define TABLE_MIN_HOLES    8
+
+static uint32_t hashBits(uint64_t bits)
+{
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// String keys are interned, so they hash and compare by identity.
+static uint32_t hashKey(Value key)
+{
+    if (IS_STRING(key)) return ((ObjString*)AS_OBJ(key))->hash;
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 1 : 2;
+    if (IS_DATETIME(key)) return hashBits((uint64_t)AS_DATETIME(key));
+
+    double number = AS_NUMBER(key);
+    if (number == 0) number = 0; // -0 equals 0
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return hashBits(bits);
+}
+
+static bool keysEqual(Value a, Value b)
+{
+    return valuesEqual(a, b);
+}
+
+// The slot in the index holding key, or failing that the slot to add it in.
+static int findSlot(ObjTable* table, Value key, bool* found)
+{
+    uint32_t mask = table->indexCapacity - 1;
+    uint32_t slot = hashKey(key) & mask;
+    int removed = -1;
+
+    for (;;)
+    {
+        int position = table->index[slot];
+        if (position == TABLE_SLOT_EMPTY)
+        {
+            *found = false;
+            return removed != -1 ? removed : (int)slot;
+        }
+        if (position == TABLE_SLOT_REMOVED)
+        {
+            if (removed == -1) removed = (int)slot;
+        }
+        else if (keysEqual(table->keys.values[position], key))
+        {
+            *found = true;
+            return (int)slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+// Smallest index that keeps count keys under two thirds full.
+static int indexCapacityFor(int count)
+{
+    int capacity = 8;
+    while (capacity * 2 < count * 3) capacity *= 2;
+    return capacity;
+}
+
+static void rebuildIndex(ObjTable* table, int capacity)
+{
+    int* index = ALLOCATE(int, capacity);
+    for (int i = 0; i < capacity; i++)
+        index[i] = TABLE_SLOT_EMPTY;
+
+    FREE_ARRAY(int, table->index, table->indexCapacity);
+    table->index = index;
+    table->indexCapacity = capacity;
+    table->indexUsed = 0;
+
+    for (int i = 0; i < table->keys.count; i++)
+    {
+        if (IS_UNDEFINED(table->keys.values[i])) continue;
+
+        bool found;
+        int slot = findSlot(table, table->keys.values[i], &found);
+        table->index[slot] = i;
+        table->indexUsed++;
+    }
+}
+
+static void shrinkArray(ValueArray* array)
+{
+    int capacity = array->count < 8 ? 8 : array->count;
+    if (array->capacity <= capacity * 2) return;
+
+    array->values = GROW_ARRAY(Value, array->values, array->capacity, capacity);
+    array->capacity = capacity;
+}
+
+// Squeezes out the holes left by removed keys and frees the memory they
+// held, then rebuilds the index to match.
+static void compactTable(ObjTable* table)
+{
+    int live = 0;
+    for (int i = 0; i < table->keys.count; i++)
+    {
+        if (IS_UNDEFINED(table->keys.values[i])) continue;
+
+        table->keys.values[live] = table->keys.values[i];
+        table->values.values[live] = table->values.values[i];
+        live++;
+    }
+    table->keys.count = live;
+    table->values.count = live;
+
+    shrinkArray(&table->keys);
+    shrinkArray(&table->values);
+    rebuildIndex(table, indexCapacityFor(live));
+}
+
+// Makes room for capacity keys so adding them neither grows the arrays
+// nor rebuilds the index.
+void reserveTable(ObjTable* table, int capacity)
+{
+    reserveValueArray(&table->keys, capacity);
+    reserveValueArray(&table->values, capacity);
+    if (table->indexCapacity < indexCapacityFor(capacity))
+        rebuildIndex(table, indexCapacityFor(capacity));
+}
+
+bool getTableValue(ObjTable* table, Value key, Value* value)
+{
+    if (table->count == 0) return false;
+
+    bool found;
+    int slot = findSlot(table, key, &found);
+    if (!found) return false;
+
+    *value = table->values.values[table->index[slot]];
+    return true;
+}
+
+// Returns true if the key is new to the table.
+bool setTableValue(ObjTable* table, Value key, Value value)
+{
+    bool found;
+    int slot = -1;
+    if (table->count > 0)
+    {
+        slot = findSlot(table, key, &found);
+        if (found)
+        {
+            table->values.values[table->index[slot]] = value;
+            return false;
+        }
+    }
+
+    // holes left by removeTableKey are squeezed out here rather than there,
+    // so removing keys while a loop walks the table doesn't move the rest;
+    // nor is it done while a loop is running, as that would shift its keys
+    int holes = table->keys.count - table->count;
+    if (table->iterators == 0 && holes > TABLE_MIN_HOLES && holes > table->count)
+    {
+        compactTable(table);
+        slot = -1;
+    }
+
+    if ((table->indexUsed + 1) * 3 > table->indexCapacity * 2)
+    {
+        rebuildIndex(table, indexCapacityFor(table->count + 1));
+        slot = -1;
+    }
+    if (slot == -1) slot = findSlot(table, key, &found);
+
+    writeValueArray(&table->keys, key);
+    writeValueArray(&table->values, value);
+
+    if (table->index[slot] == TABLE_SLOT_EMPTY) table->indexUsed++;
+    table->index[slot] = table->keys.count - 1;
+    table->count++;
+    return true;
+}
+
+bool removeTableKey(ObjTable* table, Value key)
+{
+    if (table->count == 0) return false;
+
+    bool found;
+    int slot = findSlot(table, key, &found);
+    if (!found) return false;
+
+    int position = table->index[slot];
+    table->index[slot] = TABLE_SLOT_REMOVED;
+    table->keys.values[position] = UNDEFINED_VAL;
+    table->values.values[position] = NIL_VAL;
+    table->count--;
+
+    // holes at the end can simply be dropped
+    while (table->keys.count > 0 &&
+           IS_UNDEFINED(table->keys.values[table->keys.count - 1]))
+    {
+        table->keys.count--;
+        table->values.count--;
+    }
+
+    return true;
+}
+
 static ObjClass* createClass(ObjString* name, bool module) 
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name; 
     klass->module = module;
+    klass->shape = NULL;
+    klass->slotHint = 0;
     initTable(&klass->methods);
+
+    push(OBJ_VAL(klass));
+    klass->shape = newShape(NULL, NULL);
+    pop();
     return klass;
 }
 
@@ -133,17 +518,31 @@ ObjEnum* newEnum(ObjString* name)
     return _enum;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) 
+ObjCursor* newCursor()
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    ObjCursor* cursor = ALLOCATE_OBJ(ObjCursor, OBJ_CURSOR);
+    cursor->stmt = NULL;
+    cursor->sql = NULL;
+    cursor->names = NULL;
+    cursor->row = NULL;
+    cursor->reuseRow = false;
+    return cursor;
+}
 
+// Allocates a string with room for length characters, stored inline after
+// the header, for the caller to fill in. Runtime strings aren't interned,
+// and their hash is only worked out if something asks for it. See
+// internString.
+ObjString* allocateString(int length) 
+{
+    ObjString* string = (ObjString*)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
+    string->length = length;
+    string->chars = (char*)(string + 1);
+    string->chars[length] = '\0';
+    string->hash = 0;
+    string->isRope = false;
+    string->isInterned = false;
     return string;
 }
 
@@ -158,29 +557,29 @@ static uint32_t hashString(const char* key, int length)
     return hash;
 }
 
-bool compareStrings(char* chars, int length, ObjString* compareString) 
+// A string the sweep hasn't reached yet may be dead. Handing it out again
+// brings it back, so it's marked to keep the sweep from freeing it.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-    if (interned != NULL) 
-        return interned == compareString;
-
-    return false;
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL && vm.gcState == GC_SWEEPING)
+        interned->obj.mark = vm.markBit;
+    return interned;
 }
 
-ObjString* takeString(char* chars, int length) 
+// 0 doubles as "not hashed yet"; a string that really hashes to 0 is just
+// hashed again each time.
+static uint32_t stringHash(ObjString* string)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-    if (interned != NULL) 
-    {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
-    }
+    if (string->hash == 0)
+        string->hash = hashString(string->chars, string->length);
+    return string->hash;
+}
 
-    return allocateString(chars, length, hash);
+bool compareStrings(char* chars, int length, ObjString* compareString) 
+{
+    return compareString->length == length &&
+           memcmp(flattenString(compareString)->chars, chars, length) == 0;
 }
 
 ObjString* copyString(const char* chars, int length) 
@@ -247,32 +646,141 @@ ObjString* copyString(const char* chars, int length)
         }
     }
     
-    uint32_t hash = hashString(processedString, charCount);
-    ObjString* interned = tableFindString(&vm.strings, processedString, charCount,
-                                          hash);
-    if (interned != NULL) return interned;
-
-    char* heapChars = ALLOCATE(char, charCount + 1);
-    memcpy(heapChars, processedString, charCount);
-    heapChars[charCount] = '\0';
-    
-    return allocateString(heapChars, charCount, hash);
+    ObjString* string = allocateString(charCount);
+    memcpy(string->chars, processedString, charCount);
+    return string;
 }
 
 ObjString* copyStringRaw(const char* chars, int length)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
-    if (interned != NULL) return interned;
-
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return string;
 } 
 
+// Both strings must be reachable by the collector.
+ObjString* concatenateStrings(ObjString* a, ObjString* b)
+{
+    int length = a->length + b->length;
+    if (length < ROPE_MIN_LENGTH)
+    {
+        // too short for either half to be a rope
+        ObjString* result = allocateString(length);
+        memcpy(result->chars, a->chars, a->length);
+        memcpy(result->chars + a->length, b->chars, b->length);
+        return result;
+    }
+
+    if (a->length == 0) return b;
+    if (b->length == 0) return a;
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_STRING);
+    rope->string.length = length;
+    rope->string.chars = NULL;
+    rope->string.hash = 0;
+    rope->string.isRope = true;
+    rope->string.isInterned = false;
+    rope->left = a;
+    rope->right = b;
+    return (ObjString*)rope;
+}
+
+void flattenRope(ObjString* string)
+{
+    ObjRope* rope = (ObjRope*)string;
+
+    push(OBJ_VAL(string));
+    char* chars = ALLOCATE(char, string->length + 1);
+    pop();
+
+    // Fill the buffer from the back with an explicit stack, as a rope built
+    // by a long loop is far too deep to recurse into.
+    int capacity = 16;
+    int count = 0;
+    ObjString** pending = (ObjString**)malloc(sizeof(ObjString*) * capacity);
+    if (pending == NULL) exit(1);
+    pending[count++] = string;
+
+    int end = string->length;
+    while (count > 0)
+    {
+        ObjString* node = pending[--count];
+        if (node->chars != NULL)
+        {
+            end -= node->length;
+            memcpy(chars + end, node->chars, node->length);
+            continue;
+        }
+
+        if (capacity < count + 2)
+        {
+            capacity *= 2;
+            pending = (ObjString**)realloc(pending, sizeof(ObjString*) * capacity);
+            if (pending == NULL) exit(1);
+        }
+        pending[count++] = ((ObjRope*)node)->left;
+        pending[count++] = ((ObjRope*)node)->right;
+    }
+    free(pending);
+
+    chars[string->length] = '\0';
+    string->chars = chars;
+    rope->left = NULL;
+    rope->right = NULL;
+}
+
+// Returns the interned string with the same characters, which is what
+// table keys and identifiers need. If there isn't one yet this string
+// becomes it.
+ObjString* internString(ObjString* string)
+{
+    if (string->isInterned) return string;
+
+    push(OBJ_VAL(string));
+    flattenString(string);
+    ObjString* interned = findInterned(string->chars, string->length,
+                                       stringHash(string));
+    if (interned == NULL)
+    {
+        string->isInterned = true;
+        tableSet(&vm.strings, string, NIL_VAL);
+        interned = string;
+    }
+    pop();
+    return interned;
+}
+
+// The interned string with the same characters, or NULL if there isn't
+// one. Unlike internString nothing is added, so a key that is only looked
+// up doesn't end up in the intern table.
+ObjString* findInternedString(ObjString* string)
+{
+    if (string->isInterned) return string;
+
+    push(OBJ_VAL(string));
+    flattenString(string);
+    ObjString* interned = findInterned(string->chars, string->length,
+                                       stringHash(string));
+    pop();
+    return interned;
+}
+
+bool stringsEqual(ObjString* a, ObjString* b)
+{
+    if (a == b) return true;
+    if (a->isInterned && b->isInterned) return false;
+    if (a->length != b->length) return false;
+    if (a->hash != 0 && b->hash != 0 && a->hash != b->hash) return false;
+
+    push(OBJ_VAL(a));
+    push(OBJ_VAL(b));
+    flattenString(a);
+    flattenString(b);
+    pop();
+    pop();
+    return memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 ObjUpvalue* newUpvalue(Value* slot) 
 {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
@@ -407,20 +915,23 @@ static int stringifyTable(ObjTable* table, char* str)
     char* begin = str;
     str += sprintf(str, "%s", "{");
     //str++;
+    bool first = true;
     for(int i = 0; i < table->keys.count; i++)
     {
-        if(i > 0)
+        if (IS_UNDEFINED(table->keys.values[i])) continue;
+        if(!first)
         {
             str += sprintf(str, "%s", ", ");
             //str +=2 ;
         }
+        first = false;
+        // JSON keys are strings, so number and bool keys are quoted too
         str += sprintf(str, "%s", "\"");
         str += stringifyValue(table->keys.values[i], str, true);
-        str += sprintf(str, "%s", "\" : ");
+        str += sprintf(str, "%s", "\"");
+        str += sprintf(str, "%s", " : ");
 
-        Value val;
-       
-        tableGet(&table->elements, AS_STRING(table->keys.values[i]), &val);
+        Value val = table->values.values[i];
         bool quote = IS_STRING(val) || IS_DATETIME(val);
         
         if (quote) str += sprintf(str, "%s", "\"");
@@ -465,6 +976,8 @@ int stringifyObject(Value value, char* str, bool escape)
             return sprintf(str, "%s instance", AS_INSTANCE(value)->klass->name->chars);
         case OBJ_BOUND_METHOD:
             return stringifyFunction(AS_BOUND_METHOD(value)->method->function, str);
+        case OBJ_CURSOR:
+            return sprintf(str, "%s", "<cursor>");
     }
 }
 
@@ -490,19 +1003,20 @@ static int stringifyListLength(ObjList* list)
 static int stringifyTableLength(ObjTable* table)
 {
     int total = 2; // count '{' at start and '}' at end
+    bool first = true;
     for(int i = 0; i < table->keys.count; i++)
     {
-        if(i > 0)
+        if (IS_UNDEFINED(table->keys.values[i])) continue;
+        if(!first)
         {
             total += 2; // ,(space)
         }
-        total += 1; // "
+        first = false;
+        total += 2; // ""
         total += stringifyValueLength(table->keys.values[i], true);
-        total += 4; // " : (note trailing space)
+        total += 3; //  : (note trailing space)
 
-        Value val;
-       
-        tableGet(&table->elements, AS_STRING(table->keys.values[i]), &val);
+        Value val = table->values.values[i];
         bool quote = IS_STRING(val) || IS_DATETIME(val);
         
         if (quote) total++; // "
@@ -543,5 +1057,7 @@ int stringifyObjectLength(Value value, bool escape)
             return AS_INSTANCE(value)->klass->name->length + 9;
         case OBJ_BOUND_METHOD:
             return AS_BOUND_METHOD(value)->method->function->name == NULL ? 8 : AS_BOUND_METHOD(value)->method->function->name->length + 5;
+        case OBJ_CURSOR:
+            return 8;
     }
 }
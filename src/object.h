@@ -8,8 +8,8 @@
 
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 #define IS_STRING(value)        isObjType(value, OBJ_STRING)
-#define AS_STRING(value)        ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING(value)        flattenString((ObjString*)AS_OBJ(value))
+#define AS_CSTRING(value)       (AS_STRING(value)->chars)
 #define IS_FUNCTION(value)      isObjType(value, OBJ_FUNCTION)
 #define AS_FUNCTION(value)      ((ObjFunction*)AS_OBJ(value))
 #define IS_NATIVE(value)        isObjType(value, OBJ_NATIVE)
@@ -22,6 +22,8 @@
 #define AS_LIST(value)          ((ObjList*)AS_OBJ(value))
 
 #define IS_TABLE(value)          isObjType(value, OBJ_TABLE)
+#define IS_TABLE_KEY(value)      (IS_STRING(value) || IS_NUMBER(value) || \
+                                  IS_BOOL(value) || IS_DATETIME(value))
 #define AS_TABLE(value)          ((ObjTable*)AS_OBJ(value))
 
 #define IS_CLASS(value)         isObjType(value, OBJ_CLASS)
@@ -36,6 +38,9 @@
 #define IS_ENUM(value)         isObjType(value, OBJ_ENUM)
 #define AS_ENUM(value)         ((ObjEnum*)AS_OBJ(value))
 
+#define IS_CURSOR(value)       isObjType(value, OBJ_CURSOR)
+#define AS_CURSOR(value)       ((ObjCursor*)AS_OBJ(value))
+
 typedef enum {
     OBJ_STRING,
     OBJ_UPVALUE,
@@ -47,22 +52,38 @@ typedef enum {
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
     OBJ_ENUM,
-    OBJ_TABLE
+    OBJ_TABLE,
+    OBJ_CURSOR
 } ObjType;
 
 struct Obj {
     ObjType type;
     struct Obj* next;
-    bool isMarked;
+    bool mark;          // see IS_MARKED; old objects stay marked between collections
+    bool isRemembered;  // young object referenced from an old one
 };
 
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    char* chars;        // inline after the header, or a flattened rope's buffer
+    uint32_t hash;      // 0 until needed
+    bool isRope;        // see ObjRope
+    bool isInterned;    // the copy in vm.strings, see internString
 };
 
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
+
+// The result of a long concatenation. The two halves are only copied into
+// one buffer when the characters are first read, so a string built up with
+// += isn't copied on every step.
+typedef struct {
+    ObjString string;
+    ObjString* left;
+    ObjString* right;
+} ObjRope;
+
 typedef struct
 {
   Obj obj;
@@ -71,11 +92,21 @@ typedef struct
   ValueArray elements;
 } ObjList;
 
+// A hash table that keeps its keys in insertion order. keys and values are
+// parallel arrays in that order, and index maps a key's hash to its
+// position in them. A removed key leaves a hole (UNDEFINED_VAL) that is
+// compacted away by the next insert once holes outnumber the live keys,
+// unless a for-in loop is walking the table at the time.
 typedef struct
 {
   Obj obj;
-  Table elements;
   ValueArray keys;
+  ValueArray values;
+  int count;            // live keys
+  int* index;           // position, or TABLE_SLOT_EMPTY / TABLE_SLOT_REMOVED
+  int indexCapacity;
+  int indexUsed;        // slots not empty, removed ones included
+  int iterators;        // for-in loops currently walking the keys
 } ObjTable;
 
 typedef struct ObjUpvalue {
@@ -85,6 +116,45 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue* next;
 } ObjUpvalue;
 
+#define INLINE_CACHE_ENTRIES 4
+
+// Instances with more fields than this switch to a per-instance hash table.
+#define MAX_SHAPE_FIELDS 32
+
+// A shape describes the field layout shared by instances of a class that
+// added the same fields in the same order. Shapes form a tree owned by the
+// class: the root has no fields and each transition adds one.
+typedef struct Shape Shape;
+
+typedef struct {
+    ObjString* name;
+    Shape* shape;
+} ShapeTransition;
+
+struct Shape {
+    int count;
+    ObjString** names;  // field name for each slot
+    int transitionCount;
+    int transitionCapacity;
+    ShapeTransition* transitions;
+};
+
+// One receiver shape seen at a property access or invoke site. A field entry
+// remembers the slot, a method entry (index -1) the method itself, and an
+// entry with a transition adds a field by moving the instance to that shape.
+// The class is held so the GC keeps its shapes alive while they are cached.
+typedef struct {
+    struct ObjClass* klass;
+    Shape* shape;
+    Shape* transition;
+    int index;
+    Value method;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
 typedef struct {
     Obj obj;
     int arity;
@@ -92,6 +162,8 @@ typedef struct {
     int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    int cacheCount;
+    InlineCache* caches;
 } ObjFunction;
 
 typedef bool (*NativeFn)(int argCount, Value* args);
@@ -109,17 +181,24 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
     bool module;
+    Shape* shape;
+    int slotHint; // most fields seen on an instance, used to size new ones
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields; 
+    Shape* shape;   // NULL once the instance has fallen back to fields
+    Table fields;
+    int slotCapacity;
+    int inlineCapacity;
+    Value* slots;   // points at inlineSlots until the instance outgrows them
+    Value inlineSlots[];
 } ObjInstance;
 
 typedef struct
@@ -136,22 +215,51 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// Rows of a query read one at a time by a for loop. The cursor owns its
+// statement until the rows run out or it is collected.
+typedef struct {
+    Obj obj;
+    struct sqlite3_stmt* stmt;  // NULL once closed
+    char* sql;
+    ObjList* names;             // column names as interned strings
+    ObjTable* row;              // the table every row is read into, if reused
+    bool reuseRow;
+} ObjCursor;
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
 ObjNative* newNative(NativeFn function, int arity);
-ObjString* takeString(char* chars, int length);
+ObjString* allocateString(int length);
 ObjString* copyString(const char* chars, int length);
 ObjString* copyStringRaw(const char* chars, int length);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+void flattenRope(ObjString* string);
+ObjString* internString(ObjString* string);
+ObjString* findInternedString(ObjString* string);
+bool stringsEqual(ObjString* a, ObjString* b);
 ObjUpvalue* newUpvalue(Value* slot);
 ObjList* newList();
+ObjList* newListWithCapacity(int capacity);
 ObjTable* newTable();
+ObjTable* newTableWithCapacity(int capacity);
+void reserveTable(ObjTable* table, int capacity);
+bool getTableValue(ObjTable* table, Value key, Value* value);
+bool setTableValue(ObjTable* table, Value key, Value value);
+bool removeTableKey(ObjTable* table, Value key);
 ObjEnum* newEnum(ObjString* name);
+ObjCursor* newCursor();
 ObjClass* newMod(ObjString* name);
 
 bool compareStrings(char* chars, int length, ObjString* compareString);
+int shapeSlot(Shape* shape, ObjString* name);
+Shape* shapeTransition(Shape* shape, ObjString* name);
+void freeShape(Shape* shape);
+bool getField(ObjInstance* instance, ObjString* name, Value* value);
+bool setField(ObjInstance* instance, ObjString* name, Value value);
+void setFieldSlot(ObjInstance* instance, Shape* shape, int slot, Value value);
 //void printObject(Value value);
 int stringifyObject(Value value, char* str, bool escape);
 int stringifyObjectLength(Value value, bool escape);
@@ -161,4 +269,10 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline ObjString* flattenString(ObjString* string)
+{
+    if (string->chars == NULL) flattenRope(string);
+    return string;
+}
+
 #endif
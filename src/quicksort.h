@@ -1,7 +0,0 @@
-#include "value.h"
-#ifndef min_quicksort_h
-#define min_quicksort_h
-
-void sort(ValueArray* data);
-
-#endif
\ No newline at end of file
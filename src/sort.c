@@ -0,0 +1,641 @@
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "sort.h"
+#include "value.h"
+
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// A stable merge sort in the style of timsort. Runs that are already in
+// order are found and kept rather than taken apart, short runs are padded
+// out with a binary insertion sort, and runs are merged in an order that
+// keeps the merges balanced. Sorted or reversed input costs one pass.
+
+#define MIN_MERGE 32
+#define MAX_RUNS  64
+
+#define PARALLEL_SORT_MIN (1 << 17)
+#define MAX_SORT_THREADS  64
+
+typedef bool (*LessFn)(Value a, Value b);
+
+typedef struct {
+    Value key;
+    Value value;
+} SortItem;
+
+typedef struct {
+    int start;
+    int length;
+} Run;
+
+typedef struct {
+    SortItem* items;
+    SortItem* buffer;
+    LessFn less;
+    Run runs[MAX_RUNS];
+    int runCount;
+} Sorter;
+
+static bool lessNumber(Value a, Value b)
+{
+    return AS_NUMBER(a) < AS_NUMBER(b);
+}
+
+// Both strings must already be flattened.
+static bool lessString(Value a, Value b)
+{
+    ObjString* x = (ObjString*)AS_OBJ(a);
+    ObjString* y = (ObjString*)AS_OBJ(b);
+    int length = x->length < y->length ? x->length : y->length;
+    int result = memcmp(x->chars, y->chars, length);
+
+    return result != 0 ? result < 0 : x->length < y->length;
+}
+
+// Values of different types are grouped by type. Numbers, strings and
+// dates are ordered within their group, anything else keeps its order.
+static int typeRank(Value value)
+{
+    if (IS_OBJ(value)) return VAL_OBJ + AS_OBJ(value)->type;
+    return VALUE_TYPE(value);
+}
+
+static bool lessMixed(Value a, Value b)
+{
+    int rankA = typeRank(a);
+    int rankB = typeRank(b);
+    if (rankA != rankB) return rankA < rankB;
+
+    if (IS_NUMBER(a)) return lessNumber(a, b);
+    if (IS_STRING(a)) return lessString(a, b);
+    if (IS_DATETIME(a)) return AS_DATETIME(a) < AS_DATETIME(b);
+    return false;
+}
+
+// Picks the comparison for the keys, using the cheaper ones when every key
+// is a number or every key is a string.
+static LessFn chooseLess(ValueArray* keys)
+{
+    bool numbers = true;
+    bool strings = true;
+    for (int i = 0; i < keys->count; i++)
+    {
+        Value key = keys->values[i];
+        if (IS_STRING(key))
+        {
+            AS_STRING(key);
+            numbers = false;
+        }
+        else
+        {
+            strings = false;
+            if (!IS_NUMBER(key)) numbers = false;
+        }
+    }
+
+    if (numbers) return lessNumber;
+    if (strings) return lessString;
+    return lessMixed;
+}
+
+static void reverseItems(SortItem* items, int lo, int hi)
+{
+    for (hi--; lo < hi; lo++, hi--)
+    {
+        SortItem item = items[lo];
+        items[lo] = items[hi];
+        items[hi] = item;
+    }
+}
+
+// items[lo..start) is sorted, insert the rest. Equal keys go after the
+// ones already placed, which keeps the sort stable.
+static void insertionSort(Sorter* sorter, int lo, int start, int hi)
+{
+    SortItem* items = sorter->items;
+    for (int i = start; i < hi; i++)
+    {
+        SortItem item = items[i];
+        int left = lo;
+        int right = i;
+        while (left < right)
+        {
+            int middle = left + (right - left) / 2;
+            if (sorter->less(item.key, items[middle].key))
+                right = middle;
+            else
+                left = middle + 1;
+        }
+        memmove(&items[left + 1], &items[left], (i - left) * sizeof(SortItem));
+        items[left] = item;
+    }
+}
+
+// Length of the run starting at lo. A strictly descending run is reversed
+// in place; strictly, so equal keys are never swapped.
+static int countRun(Sorter* sorter, int lo, int hi)
+{
+    SortItem* items = sorter->items;
+    int end = lo + 1;
+    if (end == hi) return 1;
+
+    if (sorter->less(items[end].key, items[lo].key))
+    {
+        while (end < hi && sorter->less(items[end].key, items[end - 1].key)) end++;
+        reverseItems(items, lo, end);
+    }
+    else
+    {
+        while (end < hi && !sorter->less(items[end].key, items[end - 1].key)) end++;
+    }
+
+    return end - lo;
+}
+
+static int minRunLength(int n)
+{
+    int odd = 0;
+    while (n >= MIN_MERGE)
+    {
+        odd |= n & 1;
+        n >>= 1;
+    }
+    return n + odd;
+}
+
+static void mergeRuns(Sorter* sorter, int lo, int middle, int hi)
+{
+    SortItem* items = sorter->items;
+    LessFn less = sorter->less;
+
+    // already in order, which is the common case for nearly sorted input
+    if (!less(items[middle].key, items[middle - 1].key)) return;
+
+    // the left run's leading items that belong before the whole right run
+    // stay where they are
+    while (lo < middle && !less(items[middle].key, items[lo].key)) lo++;
+
+    int leftLength = middle - lo;
+    memcpy(sorter->buffer, &items[lo], leftLength * sizeof(SortItem));
+
+    int left = 0;
+    int right = middle;
+    int out = lo;
+    while (left < leftLength && right < hi)
+    {
+        if (less(items[right].key, sorter->buffer[left].key))
+            items[out++] = items[right++];
+        else
+            items[out++] = sorter->buffer[left++];
+    }
+    memcpy(&items[out], &sorter->buffer[left], (leftLength - left) * sizeof(SortItem));
+}
+
+static void mergeAt(Sorter* sorter, int i)
+{
+    Run* runs = sorter->runs;
+    int lo = runs[i].start;
+    int middle = runs[i + 1].start;
+    int hi = middle + runs[i + 1].length;
+
+    mergeRuns(sorter, lo, middle, hi);
+
+    runs[i].length += runs[i + 1].length;
+    if (i == sorter->runCount - 3) runs[i + 1] = runs[i + 2];
+    sorter->runCount--;
+}
+
+// Merges until the run lengths shrink faster than the Fibonacci numbers
+// from the bottom of the stack up, which bounds the stack depth.
+static void mergeCollapse(Sorter* sorter)
+{
+    Run* runs = sorter->runs;
+    while (sorter->runCount > 1)
+    {
+        int n = sorter->runCount - 2;
+        if ((n > 0 && runs[n - 1].length <= runs[n].length + runs[n + 1].length) ||
+            (n > 1 && runs[n - 2].length <= runs[n - 1].length + runs[n].length))
+        {
+            if (runs[n - 1].length < runs[n + 1].length) n--;
+        }
+        else if (runs[n].length > runs[n + 1].length)
+        {
+            break;
+        }
+        mergeAt(sorter, n);
+    }
+}
+
+// buffer must have room for count items. Nothing here allocates, so this
+// can run on a worker thread.
+static void sortItems(SortItem* items, int count, LessFn less, SortItem* buffer)
+{
+    if (count < 2) return;
+
+    Sorter sorter;
+    sorter.items = items;
+    sorter.buffer = buffer;
+    sorter.less = less;
+    sorter.runCount = 0;
+
+    if (count < MIN_MERGE)
+    {
+        insertionSort(&sorter, 0, countRun(&sorter, 0, count), count);
+        return;
+    }
+
+    int minRun = minRunLength(count);
+    for (int lo = 0; lo < count; )
+    {
+        int length = countRun(&sorter, lo, count);
+        if (length < minRun)
+        {
+            int forced = count - lo < minRun ? count - lo : minRun;
+            insertionSort(&sorter, lo, lo + length, lo + forced);
+            length = forced;
+        }
+
+        sorter.runs[sorter.runCount].start = lo;
+        sorter.runs[sorter.runCount].length = length;
+        sorter.runCount++;
+        mergeCollapse(&sorter);
+
+        lo += length;
+    }
+
+    while (sorter.runCount > 1)
+    {
+        int n = sorter.runCount - 2;
+        if (n > 0 && sorter.runs[n - 1].length < sorter.runs[n + 1].length) n--;
+        mergeAt(&sorter, n);
+    }
+}
+
+// A list of nothing but numbers has no visible order among equal values,
+// so it is sorted as raw doubles with an introsort rather than the merge
+// sort: quicksort with a median of three pivot, falling back to heapsort if
+// the partitions keep coming out lopsided.
+static void insertionSortNumbers(double* numbers, int lo, int hi)
+{
+    for (int i = lo + 1; i < hi; i++)
+    {
+        double number = numbers[i];
+        int j = i;
+        for (; j > lo && number < numbers[j - 1]; j--)
+            numbers[j] = numbers[j - 1];
+        numbers[j] = number;
+    }
+}
+
+static void siftDown(double* numbers, int root, int count)
+{
+    double number = numbers[root];
+    for (int child = root * 2 + 1; child < count; child = root * 2 + 1)
+    {
+        if (child + 1 < count && numbers[child] < numbers[child + 1]) child++;
+        if (!(number < numbers[child])) break;
+        numbers[root] = numbers[child];
+        root = child;
+    }
+    numbers[root] = number;
+}
+
+static void heapSortNumbers(double* numbers, int count)
+{
+    for (int i = count / 2 - 1; i >= 0; i--)
+        siftDown(numbers, i, count);
+
+    for (int end = count - 1; end > 0; end--)
+    {
+        double number = numbers[0];
+        numbers[0] = numbers[end];
+        numbers[end] = number;
+        siftDown(numbers, 0, end);
+    }
+}
+
+static void swapNumbers(double* a, double* b)
+{
+    double number = *a;
+    *a = *b;
+    *b = number;
+}
+
+static void introSortNumbers(double* numbers, int lo, int hi, int depth)
+{
+    while (hi - lo > MIN_MERGE / 2)
+    {
+        if (depth-- == 0)
+        {
+            heapSortNumbers(numbers + lo, hi - lo);
+            return;
+        }
+
+        int middle = lo + (hi - lo) / 2;
+        if (numbers[middle] < numbers[lo]) swapNumbers(&numbers[middle], &numbers[lo]);
+        if (numbers[hi - 1] < numbers[middle]) swapNumbers(&numbers[hi - 1], &numbers[middle]);
+        if (numbers[middle] < numbers[lo]) swapNumbers(&numbers[middle], &numbers[lo]);
+        double pivot = numbers[middle];
+
+        // bounds are checked as well, NaNs compare false both ways
+        int i = lo;
+        int j = hi - 1;
+        while (i <= j)
+        {
+            while (i < hi && numbers[i] < pivot) i++;
+            while (j > lo && pivot < numbers[j]) j--;
+            if (i <= j) swapNumbers(&numbers[i++], &numbers[j--]);
+        }
+
+        // recurse into the smaller side so the stack stays shallow
+        if (j - lo < hi - i)
+        {
+            introSortNumbers(numbers, lo, j + 1, depth);
+            lo = i;
+        }
+        else
+        {
+            introSortNumbers(numbers, i, hi, depth);
+            hi = j + 1;
+        }
+    }
+    insertionSortNumbers(numbers, lo, hi);
+}
+
+static int depthFor(int count)
+{
+    int depth = 0;
+    for (int n = count; n > 1; n >>= 1) depth += 2;
+    return depth;
+}
+
+// Long lists are split into one block per thread. The blocks are sorted
+// at the same time, then merged pairwise, a round at a time, bouncing
+// between the array and a scratch copy. None of it touches the VM: keys
+// are flattened and scratch space allocated before any thread starts.
+
+typedef struct {
+    double* numbers;        // set when sorting plain numbers
+    double* numberScratch;
+    SortItem* items;        // otherwise
+    SortItem* itemScratch;
+    LessFn less;
+    bool inScratch;         // the blocks being merged are in the scratch copy
+} SortJob;
+
+typedef struct {
+    SortJob* job;
+    int lo;
+    int middle;
+    int hi;
+} SortTask;
+
+static int sortThreads = 0;
+
+static int coreCount()
+{
+#ifdef _WIN32
+    return 1;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    return cores > MAX_SORT_THREADS ? MAX_SORT_THREADS : (int)cores;
+#endif
+}
+
+// 0 goes back to one thread per core.
+void setSortThreads(int count)
+{
+    if (count > MAX_SORT_THREADS) count = MAX_SORT_THREADS;
+    sortThreads = count < 0 ? 0 : count;
+}
+
+int getSortThreads()
+{
+    if (sortThreads == 0) sortThreads = coreCount();
+    return sortThreads;
+}
+
+static int threadsFor(int count)
+{
+    if (count < PARALLEL_SORT_MIN) return 1;
+
+    int threads = getSortThreads();
+    // each block should still be worth a thread
+    while (threads > 1 && count / threads < PARALLEL_SORT_MIN / 4) threads--;
+    return threads;
+}
+
+static void* sortBlock(void* arg)
+{
+    SortTask* task = (SortTask*)arg;
+    SortJob* job = task->job;
+    int count = task->hi - task->lo;
+
+    if (job->numbers != NULL)
+        introSortNumbers(job->numbers, task->lo, task->hi, depthFor(count));
+    else
+        sortItems(job->items + task->lo, count, job->less, job->itemScratch + task->lo);
+    return NULL;
+}
+
+// Equal keys are taken from the left block first, so merging stays stable.
+static void* mergeBlocks(void* arg)
+{
+    SortTask* task = (SortTask*)arg;
+    SortJob* job = task->job;
+    int left = task->lo;
+    int right = task->middle;
+    int out = task->lo;
+
+    if (job->numbers != NULL)
+    {
+        double* from = job->inScratch ? job->numberScratch : job->numbers;
+        double* to = job->inScratch ? job->numbers : job->numberScratch;
+        while (left < task->middle && right < task->hi)
+            to[out++] = from[right] < from[left] ? from[right++] : from[left++];
+        memcpy(&to[out], &from[left], (task->middle - left) * sizeof(double));
+        out += task->middle - left;
+        memcpy(&to[out], &from[right], (task->hi - right) * sizeof(double));
+    }
+    else
+    {
+        SortItem* from = job->inScratch ? job->itemScratch : job->items;
+        SortItem* to = job->inScratch ? job->items : job->itemScratch;
+        while (left < task->middle && right < task->hi)
+        {
+            if (job->less(from[right].key, from[left].key))
+                to[out++] = from[right++];
+            else
+                to[out++] = from[left++];
+        }
+        memcpy(&to[out], &from[left], (task->middle - left) * sizeof(SortItem));
+        out += task->middle - left;
+        memcpy(&to[out], &from[right], (task->hi - right) * sizeof(SortItem));
+    }
+    return NULL;
+}
+
+// Runs the tasks on their own threads, the last one on this thread. A task
+// whose thread can't be started runs here too.
+static void runTasks(SortTask* tasks, int count, void* (*work)(void*))
+{
+#ifdef _WIN32
+    for (int i = 0; i < count; i++) work(&tasks[i]);
+#else
+    pthread_t threads[MAX_SORT_THREADS];
+    bool started[MAX_SORT_THREADS];
+
+    for (int i = 0; i < count - 1; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, work, &tasks[i]) == 0;
+        if (!started[i]) work(&tasks[i]);
+    }
+    work(&tasks[count - 1]);
+
+    for (int i = 0; i < count - 1; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+#endif
+}
+
+static void parallelSort(SortJob* job, int count, int threads)
+{
+    SortTask tasks[MAX_SORT_THREADS];
+    int bounds[MAX_SORT_THREADS + 1];
+    int blocks = threads;
+
+    for (int i = 0; i <= blocks; i++)
+        bounds[i] = (int)((long long)count * i / blocks);
+
+    for (int i = 0; i < blocks; i++)
+    {
+        tasks[i].job = job;
+        tasks[i].lo = bounds[i];
+        tasks[i].hi = bounds[i + 1];
+    }
+    runTasks(tasks, blocks, sortBlock);
+
+    job->inScratch = false;
+    while (blocks > 1)
+    {
+        // an odd block out is merged with nothing, which copies it across
+        int merges = 0;
+        for (int i = 0; i < blocks; i += 2)
+        {
+            tasks[merges].job = job;
+            tasks[merges].lo = bounds[i];
+            tasks[merges].middle = bounds[i + 1];
+            tasks[merges].hi = i + 1 < blocks ? bounds[i + 2] : bounds[i + 1];
+            merges++;
+        }
+        runTasks(tasks, merges, mergeBlocks);
+
+        for (int i = 0; i < merges; i++)
+            bounds[i] = tasks[i].lo;
+        bounds[merges] = count;
+        blocks = merges;
+        job->inScratch = !job->inScratch;
+    }
+
+    if (job->inScratch)
+    {
+        if (job->numbers != NULL)
+            memcpy(job->numbers, job->numberScratch, count * sizeof(double));
+        else
+            memcpy(job->items, job->itemScratch, count * sizeof(SortItem));
+    }
+}
+
+static bool sortNumbers(ValueArray* values)
+{
+    int count = values->count;
+    for (int i = 0; i < count; i++)
+        if (!IS_NUMBER(values->values[i])) return false;
+
+    bool sorted = true;
+    for (int i = 1; i < count && sorted; i++)
+        sorted = !(AS_NUMBER(values->values[i]) < AS_NUMBER(values->values[i - 1]));
+    if (sorted) return true;
+
+    double* numbers = ALLOCATE(double, count);
+    for (int i = 0; i < count; i++)
+        numbers[i] = AS_NUMBER(values->values[i]);
+
+    int threads = threadsFor(count);
+    if (threads > 1)
+    {
+        SortJob job;
+        job.numbers = numbers;
+        job.numberScratch = ALLOCATE(double, count);
+        job.items = NULL;
+        parallelSort(&job, count, threads);
+        FREE_ARRAY(double, job.numberScratch, count);
+    }
+    else
+    {
+        introSortNumbers(numbers, 0, count, depthFor(count));
+    }
+
+    for (int i = 0; i < count; i++)
+        values->values[i] = NUMBER_VAL(numbers[i]);
+    FREE_ARRAY(double, numbers, count);
+    return true;
+}
+
+// Sorting doesn't allocate objects, so the values stay reachable through
+// the arrays they came from while they are copied out.
+static void sortWithKeys(ValueArray* values, ValueArray* keys)
+{
+    int count = values->count;
+    if (count < 2) return;
+
+    LessFn less = chooseLess(keys);
+
+    SortItem* items = ALLOCATE(SortItem, count);
+    for (int i = 0; i < count; i++)
+    {
+        items[i].key = keys->values[i];
+        items[i].value = values->values[i];
+    }
+
+    SortItem* buffer = ALLOCATE(SortItem, count);
+    int threads = threadsFor(count);
+    if (threads > 1)
+    {
+        SortJob job;
+        job.items = items;
+        job.itemScratch = buffer;
+        job.less = less;
+        job.numbers = NULL;
+        parallelSort(&job, count, threads);
+    }
+    else
+    {
+        sortItems(items, count, less, buffer);
+    }
+    FREE_ARRAY(SortItem, buffer, count);
+
+    for (int i = 0; i < count; i++)
+    {
+        keys->values[i] = items[i].key;
+        values->values[i] = items[i].value;
+    }
+    FREE_ARRAY(SortItem, items, count);
+}
+
+void sortValues(ValueArray* values)
+{
+    if (values->count < 2 || sortNumbers(values)) return;
+    sortWithKeys(values, values);
+}
+
+// keys holds one key per value and is reordered along with them.
+void sortValuesByKeys(ValueArray* values, ValueArray* keys)
+{
+    sortWithKeys(values, keys);
+}
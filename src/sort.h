@@ -0,0 +1,10 @@
+#include "value.h"
+#ifndef min_sort_h
+#define min_sort_h
+
+void sortValues(ValueArray* values);
+void sortValuesByKeys(ValueArray* values, ValueArray* keys);
+void setSortThreads(int count);
+int getSortThreads();
+
+#endif
@@ -1,7 +1,22 @@
 #ifndef sm_sql_h
 #define sm_sql_h
 
+#include "../object.h"
+
 bool queryNative(int argCount, Value* args);
+bool cursorNative(int argCount, Value* args);
+bool batchNative(int argCount, Value* args);
 bool setdbNative(int argCount, Value* args);
+bool cachesizeNative(int argCount, Value* args);
+bool reuserowsNative(int argCount, Value* args);
+bool dbstatsNative(int argCount, Value* args);
+bool dbopenNative(int argCount, Value* args);
+bool dbcloseNative(int argCount, Value* args);
+bool useNative(int argCount, Value* args);
+bool dbqueryNative(int argCount, Value* args);
+bool attachNative(int argCount, Value* args);
+bool pragmaNative(int argCount, Value* args);
+bool nextRow(ObjCursor* cursor, Value* row);
+void closeCursor(ObjCursor* cursor);
 
-#endif
\ No newline at end of file
+#endif
@@ -8,155 +8,458 @@
 #include "../object.h"
 #include "../vm.h"
 #include "../memory.h"
+#include "sql.h"
 
-#define MAX_CACHE_QUERY 8192
+#define STATEMENT_CACHE_DEFAULT 16
+#define STATEMENT_CACHE_MAX     256
+#define MAX_CONNECTIONS         16
 
-static char dbname[1025] = {0};
-static sqlite3* db = NULL;
-static char lastQuery[MAX_CACHE_QUERY] = {0};
-static sqlite3_stmt *stmt = NULL;
+// Prepared statements are kept by their SQL text and reused, the least
+// recently used one making way when the cache is full.
+typedef struct {
+    char* sql;
+    uint32_t hash;
+    sqlite3_stmt* stmt;
+    unsigned long lastUsed;
+} CachedStatement;
 
-int queryNative(int argCount, Value* args) 
-{   
-    ObjList* list;
-    //char *err_msg = NULL;
-    int rc;
-    
-    if (db == NULL)
-    {
-        if (dbname[0] == '\0')
-            rc = sqlite3_open(":memory:", &db);
-        else
-            rc = sqlite3_open(dbname, &db);
+// Connections are referred to from scripts by their index. Handle 0 is the
+// one setdb points at; db.open fills the others. Each has its own cache.
+typedef struct {
+    sqlite3* db;        // opened on first use, NULL again once closed
+    char name[1025];    // empty for an in-memory database
+    bool open;          // the handle is in use, which 0 always is
+    CachedStatement statements[STATEMENT_CACHE_MAX];
+    int statementCount;
+    int cacheSize;
+    unsigned long useCount;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+} Connection;
 
-        if (rc != SQLITE_OK) 
-        {
-            char buffer[100];
+static Connection connections[MAX_CONNECTIONS] = {
+    { .open = true, .cacheSize = STATEMENT_CACHE_DEFAULT }
+};
+static Connection* conn = &connections[0];  // where $"..." runs, see db.use
+static bool reuseRows = false;
+
+static uint32_t hashSql(const char* sql)
+{
+    uint32_t hash = 2166136261u;
+    for (; *sql != '\0'; sql++)
+    {
+        hash ^= (uint8_t)*sql;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void evictStatement(Connection* c, int index)
+{
+    sqlite3_finalize(c->statements[index].stmt);
+    free(c->statements[index].sql);
+    c->statements[index] = c->statements[--c->statementCount];
+}
+
+static void evictLeastRecent(Connection* c)
+{
+    int oldest = 0;
+    for (int i = 1; i < c->statementCount; i++)
+        if (c->statements[i].lastUsed < c->statements[oldest].lastUsed) oldest = i;
+    evictStatement(c, oldest);
+}
+
+static void clearStatements(Connection* c)
+{
+    while (c->statementCount > 0) evictStatement(c, c->statementCount - 1);
+}
+
+static int findStatement(Connection* c, const char* sql, uint32_t hash)
+{
+    for (int i = 0; i < c->statementCount; i++)
+    {
+        if (c->statements[i].hash == hash && strcmp(c->statements[i].sql, sql) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void cacheStatement(Connection* c, char* sql, uint32_t hash, sqlite3_stmt* stmt)
+{
+    if (c->statementCount >= c->cacheSize) evictLeastRecent(c);
+    CachedStatement* entry = &c->statements[c->statementCount++];
+    entry->sql = sql;
+    entry->hash = hash;
+    entry->stmt = stmt;
+    entry->lastUsed = ++c->useCount;
+}
+
+// Finds or prepares the statement for sql, which the cache takes ownership
+// of when it keeps the statement. *cached says whether it did; if not, the
+// caller finalizes the statement and frees sql.
+static sqlite3_stmt* prepareStatement(Connection* c, char* sql, bool* cached)
+{
+    uint32_t hash = hashSql(sql);
+    int index = findStatement(c, sql, hash);
+    if (index >= 0)
+    {
+        c->cacheHits++;
+        c->statements[index].lastUsed = ++c->useCount;
+        *cached = true;
+        free(sql);
+        return c->statements[index].stmt;
+    }
+
+    c->cacheMisses++;
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+        *cached = false;
+        return NULL;
+    }
+
+    *cached = c->cacheSize > 0;
+    if (*cached) cacheStatement(c, sql, hash, stmt);
+    return stmt;
+}
+
+// Like prepareStatement, but a cached statement is taken out of the cache so
+// a cursor can step it while other queries, even with the same text, run.
+// The caller owns both sql and the statement; see releaseStatement.
+static sqlite3_stmt* takeStatement(Connection* c, const char* sql)
+{
+    int index = findStatement(c, sql, hashSql(sql));
+    if (index >= 0)
+    {
+        c->cacheHits++;
+        sqlite3_stmt* stmt = c->statements[index].stmt;
+        free(c->statements[index].sql);
+        c->statements[index] = c->statements[--c->statementCount];
+        return stmt;
+    }
 
-            sprintf(buffer, "Failed to open database: %s", dbname);
-            NATIVE_ERROR(buffer);
+    c->cacheMisses++;
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    return stmt;
+}
+
+// Puts a taken statement back in the cache of the connection it was
+// prepared on, unless that has been closed since or already has one for the
+// same text.
+static void releaseStatement(char* sql, sqlite3_stmt* stmt)
+{
+    Connection* c = NULL;
+    for (int i = 0; i < MAX_CONNECTIONS && c == NULL; i++)
+    {
+        if (connections[i].db != NULL && connections[i].db == sqlite3_db_handle(stmt))
+            c = &connections[i];
+    }
+
+    uint32_t hash = hashSql(sql);
+    if (c == NULL || c->cacheSize == 0 || findStatement(c, sql, hash) >= 0)
+    {
+        sqlite3_finalize(stmt);
+        free(sql);
+        return;
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    cacheStatement(c, sql, hash, stmt);
+}
+
+// Integers and reals come back as numbers, NULL as nil and anything else
+// as a string of its bytes.
+static Value columnValue(sqlite3_stmt* statement, int column)
+{
+    switch (sqlite3_column_type(statement, column))
+    {
+        case SQLITE_INTEGER:
+            return NUMBER_VAL((double)sqlite3_column_int64(statement, column));
+        case SQLITE_FLOAT:
+            return NUMBER_VAL(sqlite3_column_double(statement, column));
+        case SQLITE_NULL:
+            return NIL_VAL;
+        case SQLITE_BLOB: {
+            const char* bytes = (const char*)sqlite3_column_blob(statement, column);
+            int length = sqlite3_column_bytes(statement, column);
+            return OBJ_VAL(copyStringRaw(bytes == NULL ? "" : bytes, length));
+        }
+        default: {
+            const char* text = (const char*)sqlite3_column_text(statement, column);
+            int length = sqlite3_column_bytes(statement, column);
+            return OBJ_VAL(copyStringRaw(text, length));
         }
     }
+}
 
-    // get sql string
-    // step 1 - work out how much memory to allocate
+static bool openDatabase(Connection* c)
+{
+    if (c->db != NULL) return true;
+
+    if (sqlite3_open(c->name[0] == '\0' ? ":memory:" : c->name, &c->db) == SQLITE_OK)
+        return true;
+
+    sqlite3_close(c->db);
+    c->db = NULL;
+    return false;
+}
+
+static void closeDatabase(Connection* c)
+{
+    clearStatements(c);
+    sqlite3_close_v2(c->db);
+    c->db = NULL;
+}
+
+static bool openFailed(Connection* c, Value* args)
+{
+    char buffer[1100];
+    snprintf(buffer, sizeof(buffer), "Failed to open database: %s", c->name);
+    NATIVE_ERROR(buffer);
+}
+
+static bool statementFailed(Connection* c, Value* args)
+{
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "Failed to execute statement: %s", sqlite3_errmsg(c->db));
+    NATIVE_ERROR(buffer);
+}
+
+// The compiler passes the text of a sql literal as strings at the even
+// arguments with the parameters between them, which become " ? ".
+static char* buildSql(int argCount, Value* args)
+{
     int length = 1;
-    for(int i = 0; i < argCount; i++)
+    for (int i = 0; i < argCount; i++)
     {
-        if(i % 2 == 0)
-        {
+        if (i % 2 == 0)
             length += AS_STRING(args[i])->length;
-        }
         else
-        {
             length += 3;
-        }
     }
+
     char* sql = (char*)malloc(length);
-    char *start = sql;
-    
-    // step 2 - create the string
-    for(int i = 0; i < argCount; i++)
+    char* end = sql;
+    for (int i = 0; i < argCount; i++)
     {
-        if(i % 2 == 0)
+        if (i % 2 == 0)
         {
-            memcpy(sql, AS_STRING(args[i])->chars, AS_STRING(args[i])->length);
-            sql += AS_STRING(args[i])->length;
+            memcpy(end, AS_STRING(args[i])->chars, AS_STRING(args[i])->length);
+            end += AS_STRING(args[i])->length;
         }
         else
         {
-            memcpy(sql, " ? ", 3);
-            sql += 3;
+            memcpy(end, " ? ", 3);
+            end += 3;
         }
-
     }
-    *sql = '\0';
+    *end = '\0';
+    return sql;
+}
 
-    //step 3 cashe the query 
-    if (!(lastQuery[0] != '\0' && strcmp(lastQuery, start) == 0))
-    {
-        //printf("execute new query\n");
-        if (length < MAX_CACHE_QUERY)
-            memcpy(lastQuery, start, length);
+static char* copySql(ObjString* text)
+{
+    char* sql = (char*)malloc(text->length + 1);
+    memcpy(sql, text->chars, text->length + 1);
+    return sql;
+}
 
-        sqlite3_finalize(stmt);
-        rc = sqlite3_prepare_v2(db, start, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) 
-        {
-            NATIVE_ERROR("Failed to execute statement");
-            //fprintf(stderr, "Failed to execute statement: %s\n", sqlite3_errmsg(db));     
-        }
-    }
+static bool bindValue(sqlite3_stmt* stmt, int param, Value value,
+                      sqlite3_destructor_type text)
+{
+    if (IS_NUMBER(value))
+        sqlite3_bind_double(stmt, param, AS_NUMBER(value));
+    else if (IS_STRING(value))
+        sqlite3_bind_text(stmt, param, AS_CSTRING(value), -1, text);
+    else if (IS_NIL(value))
+        sqlite3_bind_null(stmt, param);
+    else
+        return false;
+    return true;
+}
 
-    // bind the parameters
+// Text is bound with SQLITE_STATIC when the statement is stepped before the
+// arguments can go away, and copied otherwise.
+static bool bindParameters(sqlite3_stmt* stmt, int argCount, Value* args,
+                           sqlite3_destructor_type text)
+{
     sqlite3_reset(stmt);
     int paramNum = 1;
-    for(int i = 1; i < argCount; i++)
+    for (int i = 1; i < argCount; i += 2)
     {
-        if(i % 2 != 0)
-        {
-            if (IS_NUMBER(args[i]))
-                sqlite3_bind_double(stmt, paramNum++, AS_NUMBER(args[i]));
-            else if (IS_STRING(args[i]))
-                sqlite3_bind_text(stmt, paramNum++, AS_CSTRING(args[i]), -1, SQLITE_STATIC);
-            else if (IS_NIL(args[i]))
-                sqlite3_bind_null(stmt, paramNum++);
-            else
-            {
-                NATIVE_ERROR("Only numbers are strings can be passed as parameter values to a sql");
-            }
-        }
+        if (!bindValue(stmt, paramNum++, args[i], text)) return false;
     }
+    return true;
+}
 
-    list = newList();
+// The column names are made into keys once, not once per row.
+static ObjList* columnNames(sqlite3_stmt* stmt)
+{
+    int columnCount = sqlite3_column_count(stmt);
+    ObjList* names = newListWithCapacity(columnCount);
+    push(OBJ_VAL(names));
+    for (int i = 0; i < columnCount; i++)
+    {
+        const char* columnName = sqlite3_column_name(stmt, i);
+        Value name = OBJ_VAL(internString(copyStringRaw(columnName, strlen(columnName))));
+        writeValueArray(&names->elements, name);
+        WRITE_BARRIER(names, name);
+    }
+    pop();
+    return names;
+}
+
+static void readRow(sqlite3_stmt* stmt, ObjList* names, ObjTable* table)
+{
+    for (int i = 0; i < names->elements.count; i++)
+    {
+        Value value = columnValue(stmt, i);
+        push(value);
+        setTableValue(table, names->elements.values[i], value);
+        WRITE_BARRIER(table, names->elements.values[i]);
+        WRITE_BARRIER(table, value);
+        pop();
+    }
+}
+
+// Steps stmt to the end, returning its rows as a list of tables.
+static ObjList* readRows(sqlite3_stmt* stmt)
+{
+    ObjList* list = newList();
     push(OBJ_VAL(list));
+    ObjList* names = columnNames(stmt);
+    push(OBJ_VAL(names));
+
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        ObjTable* table = newTableWithCapacity(names->elements.count);
+        push(OBJ_VAL(table));
+        readRow(stmt, names, table);
+        writeValueArray(&list->elements, OBJ_VAL(table));
+        WRITE_BARRIER(list, OBJ_VAL(table));
+        pop();
+    }
+
+    pop(); // names
+    pop();
+    return list;
+}
+
+bool queryNative(int argCount, Value* args) 
+{   
+    if (!openDatabase(conn)) return openFailed(conn, args);
 
-    int step;  
+    char* sql = buildSql(argCount, args);
+    bool cached;
+    sqlite3_stmt* stmt = prepareStatement(conn, sql, &cached);
+    if (stmt == NULL)
+    {
+        free(sql);
+        return statementFailed(conn, args);
+    }
 
-    do
+    if (!bindParameters(stmt, argCount, args, SQLITE_STATIC))
     {
-        step = sqlite3_step(stmt);
-        //printf("executed statement %d\n", step);
-    
-        if (step == SQLITE_ROW) 
+        if (!cached)
         {
-            ObjTable* table = newTable();
-            push(OBJ_VAL(table));
-            int count = sqlite3_column_count(stmt);
-
-            //printf("%s: ", sqlite3_column_text(res, 0));
-            //printf("%s\n", sqlite3_column_text(res, 1));
-            //-----
-            for(int i=0; i < count; i++)
-            {
-                const char* columnName = sqlite3_column_name(stmt, i);
-                ObjString* key = copyStringRaw(columnName, strlen(columnName));
-                push(OBJ_VAL(key));
-                const char* columnValue = (const char*)sqlite3_column_text(stmt, i);
-                Value value = columnValue ?  OBJ_VAL(copyStringRaw(columnValue, strlen(columnValue))) : NIL_VAL;
-                push(value);
-                setTable(OBJ_VAL(table), value, OBJ_VAL(key));
-                
-                pop();
-                pop();
-            }
-            //-----
-            writeValueArray(&list->elements, OBJ_VAL(table));
-            pop();
-        } 
-    } while (step == SQLITE_ROW);
-    
-    //sqlite3_finalize(stmt);
-    //sqlite3_close(db);
+            sqlite3_finalize(stmt);
+            free(sql);
+        }
+        NATIVE_ERROR("Only numbers are strings can be passed as parameter values to a sql");
+    }
 
-    free(start);
+    ObjList* list = readRows(stmt);
+    if (!cached)
+    {
+        sqlite3_finalize(stmt);
+        free(sql);
+    }
 
     args[-1] = OBJ_VAL(list);
+    return true;
+}
+
+// for row in $"select ..." calls this instead of query, so the rows are
+// stepped through by the loop rather than read into a list first.
+bool cursorNative(int argCount, Value* args)
+{
+    if (!openDatabase(conn)) return openFailed(conn, args);
+
+    char* sql = buildSql(argCount, args);
+    sqlite3_stmt* stmt = takeStatement(conn, sql);
+    if (stmt == NULL)
+    {
+        free(sql);
+        return statementFailed(conn, args);
+    }
+
+    if (!bindParameters(stmt, argCount, args, SQLITE_TRANSIENT))
+    {
+        releaseStatement(sql, stmt);
+        NATIVE_ERROR("Only numbers are strings can be passed as parameter values to a sql");
+    }
+
+    // the names are made first so the cursor is never older than them
+    ObjList* names = columnNames(stmt);
+    push(OBJ_VAL(names));
+    ObjCursor* cursor = newCursor();
+    cursor->stmt = stmt;
+    cursor->sql = sql;
+    cursor->reuseRow = reuseRows;
+    cursor->names = names;
+    WRITE_BARRIER(cursor, OBJ_VAL(names));
+
+    args[-1] = OBJ_VAL(cursor);
     pop();
+    return true;
+}
+
+// Reads the next row into *row, or closes the cursor and returns false once
+// there are none left.
+bool nextRow(ObjCursor* cursor, Value* row)
+{
+    if (cursor->stmt == NULL) return false;
+    if (sqlite3_step(cursor->stmt) != SQLITE_ROW)
+    {
+        closeCursor(cursor);
+        return false;
+    }
 
+    ObjTable* table = cursor->row;
+    if (table == NULL)
+    {
+        table = newTableWithCapacity(cursor->names->elements.count);
+        if (cursor->reuseRow)
+        {
+            cursor->row = table;
+            WRITE_BARRIER(cursor, OBJ_VAL(table));
+        }
+    }
+
+    push(OBJ_VAL(table));
+    readRow(cursor->stmt, cursor->names, table);
+    pop();
+
+    *row = OBJ_VAL(table);
     return true;
 }
 
+// A loop left early only closes its cursor when the cursor is collected.
+void closeCursor(ObjCursor* cursor)
+{
+    if (cursor->stmt == NULL) return;
+    releaseStatement(cursor->sql, cursor->stmt);
+    cursor->stmt = NULL;
+    cursor->sql = NULL;
+}
+
 bool setdbNative(int argCount, Value* args)
 {
     CHECK_STRING(0, "setdb expects a string");
@@ -168,27 +471,394 @@ bool setdbNative(int argCount, Value* args)
         NATIVE_ERROR("File path too large.  Max is 1024 characters.");
     }
 
+    // setdb always points handle 0 elsewhere, whichever db.use picked
+    Connection* c = &connections[0];
     if (length > 0)
     {
-        //dbname = AS_CSTRING(args[0]);
-        memcpy(dbname, AS_CSTRING(args[0]), length);
-        dbname[length] = '\0';
-        sqlite3_close_v2(db);
-        db = NULL;
+        memcpy(c->name, AS_CSTRING(args[0]), length);
+        c->name[length] = '\0';
+        closeDatabase(c);
     }
 
-    args[-1] = OBJ_VAL(copyStringRaw(dbname, strlen(dbname)));
+    args[-1] = OBJ_VAL(copyStringRaw(c->name, strlen(c->name)));
 
     return true;
 }
 
 bool closedbNative(int argCount, Value* args)
 {
+    closeDatabase(&connections[0]);
+
+    return true;
+}
+
+static bool execute(Connection* c, const char* sql)
+{
+    return sqlite3_exec(c->db, sql, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+// db.batch(sql, rows) runs sql once for each list of parameters in rows,
+// which fill its ? placeholders in order. Unless a transaction is already
+// open the whole batch is one transaction, rolled back if any row fails.
+// Returns the number of rows changed.
+bool batchNative(int argCount, Value* args)
+{
+    CHECK_STRING(0, "batch() expects sql text and a list of parameter lists");
+    CHECK_LIST(1, "batch() expects sql text and a list of parameter lists");
+
+    if (!openDatabase(conn)) return openFailed(conn, args);
+
+    char* sql = copySql(AS_STRING(args[0]));
+    bool cached;
+    sqlite3_stmt* stmt = prepareStatement(conn, sql, &cached);
+    if (stmt == NULL)
+    {
+        free(sql);
+        return statementFailed(conn, args);
+    }
+
+    bool transaction = sqlite3_get_autocommit(conn->db) && execute(conn, "BEGIN");
+    ObjList* rows = AS_LIST(args[1]);
+    int params = sqlite3_bind_parameter_count(stmt);
+    double changes = 0;
+    char error[256] = {0};
+
+    for (int i = 0; i < rows->elements.count && error[0] == '\0'; i++)
+    {
+        Value row = rows->elements.values[i];
+        if (!IS_LIST(row) || AS_LIST(row)->elements.count != params)
+        {
+            snprintf(error, sizeof(error),
+                     "batch() row %d is not a list of %d parameters", i, params);
+            break;
+        }
+
+        sqlite3_reset(stmt);
+        for (int p = 0; p < params; p++)
+        {
+            if (!bindValue(stmt, p + 1, AS_LIST(row)->elements.values[p], SQLITE_STATIC))
+            {
+                snprintf(error, sizeof(error),
+                         "batch() row %d: only numbers, strings and nil can be parameters", i);
+                break;
+            }
+        }
+        if (error[0] != '\0') break;
+
+        int step;
+        while ((step = sqlite3_step(stmt)) == SQLITE_ROW);
+        if (step != SQLITE_DONE)
+        {
+            snprintf(error, sizeof(error), "batch() row %d failed: %s", i, sqlite3_errmsg(conn->db));
+            break;
+        }
+        changes += sqlite3_changes(conn->db);
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (!cached)
+    {
+        sqlite3_finalize(stmt);
+        free(sql);
+    }
+
+    if (error[0] != '\0')
+    {
+        if (transaction) execute(conn, "ROLLBACK");
+        NATIVE_ERROR(error);
+    }
+    if (transaction && !execute(conn, "COMMIT"))
+    {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "batch() failed to commit: %s", sqlite3_errmsg(conn->db));
+        execute(conn, "ROLLBACK");
+        NATIVE_ERROR(buffer);
+    }
+
+    args[-1] = NUMBER_VAL(changes);
+    return true;
+}
+
+// db.cachesize(n) sets how many prepared statements are kept, 0 turning the
+// cache off, and returns the old size.
+bool cachesizeNative(int argCount, Value* args)
+{
+    CHECK_NUM(0, "cachesize() expects a number of statements");
+
+    int size = (int)AS_NUMBER(args[0]);
+    if (size < 0 || size > STATEMENT_CACHE_MAX)
+    {
+        NATIVE_ERROR("cachesize() must be between 0 and 256");
+    }
+
+    args[-1] = NUMBER_VAL(conn->cacheSize);
+    conn->cacheSize = size;
+    while (conn->statementCount > conn->cacheSize) evictLeastRecent(conn);
+    return true;
+}
+
+// db.reuserows(true) makes for loops over a query read every row into the
+// same table, so a row has to be copied to be kept. Returns the old setting.
+bool reuserowsNative(int argCount, Value* args)
+{
+    CHECK_BOOL(0, "reuserows() expects true or false");
+
+    args[-1] = BOOL_VAL(reuseRows);
+    reuseRows = AS_BOOL(args[0]);
+    return true;
+}
+
+static void setStat(ObjTable* table, const char* name, Value value)
+{
+    push(OBJ_VAL(copyStringRaw(name, (int)strlen(name))));
+    setTable(OBJ_VAL(table), value, vm.stackTop[-1]);
+    pop();
+}
+
+bool dbstatsNative(int argCount, Value* args)
+{
+    ObjTable* table = newTable();
+    push(OBJ_VAL(table));
+
+    setStat(table, "hits", NUMBER_VAL((double)conn->cacheHits));
+    setStat(table, "misses", NUMBER_VAL((double)conn->cacheMisses));
+    setStat(table, "cached", NUMBER_VAL(conn->statementCount));
+    setStat(table, "cachesize", NUMBER_VAL(conn->cacheSize));
+
+    args[-1] = OBJ_VAL(table);
+    pop();
+    return true;
+}
+
+static Connection* connectionArg(Value value)
+{
+    if (!IS_NUMBER(value)) return NULL;
+    int handle = (int)AS_NUMBER(value);
+    if (handle < 0 || handle >= MAX_CONNECTIONS || !connections[handle].open)
+        return NULL;
+    return &connections[handle];
+}
+
+#define CHECK_CONNECTION(argnum, name) \
+    Connection* c = connectionArg(args[argnum]); \
+    if (c == NULL) \
+    { \
+        NATIVE_ERROR(name "() expects an open database handle"); \
+    } \
+    if (!openDatabase(c)) return openFailed(c, args);
+
+// Pragma names and schema aliases can't be bound as parameters, so they are
+// checked to be plain identifiers before going into the sql text.
+static bool isIdentifier(ObjString* name)
+{
+    if (name->length == 0) return false;
+    for (int i = 0; i < name->length; i++)
+    {
+        char ch = name->chars[i];
+        if (!(ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+              (i > 0 && ch >= '0' && ch <= '9')))
+            return false;
+    }
+    return true;
+}
+
+// db.open(path) opens another connection, ":memory:" for an in-memory one,
+// and returns its handle.
+bool dbopenNative(int argCount, Value* args)
+{
+    CHECK_STRING(0, "open() expects a file path");
+
+    ObjString* path = AS_STRING(args[0]);
+    if (path->length > 1024)
+    {
+        NATIVE_ERROR("File path too large.  Max is 1024 characters.");
+    }
+
+    int handle = 1;
+    while (handle < MAX_CONNECTIONS && connections[handle].open) handle++;
+    if (handle == MAX_CONNECTIONS)
+    {
+        NATIVE_ERROR("Too many open databases");
+    }
+
+    Connection* c = &connections[handle];
+    memcpy(c->name, path->chars, path->length + 1);
+    if (!openDatabase(c)) return openFailed(c, args);
+
+    c->open = true;
+    c->statementCount = 0;
+    c->cacheSize = STATEMENT_CACHE_DEFAULT;
+    c->useCount = 0;
+    c->cacheHits = 0;
+    c->cacheMisses = 0;
+
+    args[-1] = NUMBER_VAL(handle);
+    return true;
+}
+
+// db.close(handle) closes a connection. Handle 0 stays usable and opens
+// again on its next query; $"..." goes back to it if it was using the one
+// closed.
+bool dbcloseNative(int argCount, Value* args)
+{
+    Connection* c = connectionArg(args[0]);
+    if (c == NULL)
+    {
+        NATIVE_ERROR("close() expects an open database handle");
+    }
+
+    closeDatabase(c);
+    if (c != &connections[0])
+    {
+        c->open = false;
+        if (conn == c) conn = &connections[0];
+    }
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// db.use(handle) makes $"..." run on that connection and returns the handle
+// it used before.
+bool useNative(int argCount, Value* args)
+{
+    Connection* c = connectionArg(args[0]);
+    if (c == NULL)
+    {
+        NATIVE_ERROR("use() expects an open database handle");
+    }
+
+    args[-1] = NUMBER_VAL((double)(conn - connections));
+    conn = c;
+    return true;
+}
+
+// db.query(handle, sql, params) runs sql on the given connection, filling
+// its ? placeholders from the optional list params, and returns the rows.
+bool dbqueryNative(int argCount, Value* args)
+{
+    if (argCount != 2 && argCount != 3)
+    {
+        NATIVE_ERROR("query() expects a handle, sql text and optionally a list of parameters");
+    }
+    CHECK_STRING(1, "query() expects sql text");
+    if (argCount == 3) 
+    {
+        CHECK_LIST(2, "query() expects its parameters as a list");
+    }
+    CHECK_CONNECTION(0, "query");
+
+    char* sql = copySql(AS_STRING(args[1]));
+    bool cached;
+    sqlite3_stmt* stmt = prepareStatement(c, sql, &cached);
+    if (stmt == NULL)
+    {
+        free(sql);
+        return statementFailed(c, args);
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    ObjList* params = argCount == 3 ? AS_LIST(args[2]) : NULL;
+    for (int i = 0; params != NULL && i < params->elements.count; i++)
+    {
+        if (!bindValue(stmt, i + 1, params->elements.values[i], SQLITE_STATIC))
+        {
+            if (!cached)
+            {
+                sqlite3_finalize(stmt);
+                free(sql);
+            }
+            NATIVE_ERROR("Only numbers, strings and nil can be parameters to query()");
+        }
+    }
+
+    ObjList* list = readRows(stmt);
+    if (!cached)
+    {
+        sqlite3_finalize(stmt);
+        free(sql);
+    }
+
+    args[-1] = OBJ_VAL(list);
+    return true;
+}
+
+// db.attach(handle, path, name) attaches another database file to the
+// connection, its tables then being name.table in queries on it.
+bool attachNative(int argCount, Value* args)
+{
+    CHECK_STRING(1, "attach() expects a file path");
+    CHECK_STRING(2, "attach() expects a schema name");
+    if (!isIdentifier(AS_STRING(args[2])))
+    {
+        NATIVE_ERROR("attach() schema name must be an identifier");
+    }
+    CHECK_CONNECTION(0, "attach");
+
+    char sql[128];
+    snprintf(sql, sizeof(sql), "ATTACH DATABASE ? AS %s", AS_CSTRING(args[2]));
+
+    sqlite3_stmt* stmt = NULL;
+    int rc = sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL);
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, AS_CSTRING(args[1]), -1, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+    }
     sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    stmt = NULL;
-    db = NULL;
-    lastQuery[0] = '\0';
+    if (rc != SQLITE_OK && rc != SQLITE_DONE) return statementFailed(c, args);
 
+    args[-1] = NIL_VAL;
     return true;
-}
\ No newline at end of file
+}
+
+// db.pragma(handle, name) reads a pragma of the connection and
+// db.pragma(handle, name, value) sets it, e.g. journal_mode to "wal" or
+// cache_size. Both return what the pragma reports, or nil.
+bool pragmaNative(int argCount, Value* args)
+{
+    if (argCount != 2 && argCount != 3)
+    {
+        NATIVE_ERROR("pragma() expects a handle, a pragma name and optionally a value");
+    }
+    CHECK_STRING(1, "pragma() expects a pragma name");
+    if (!isIdentifier(AS_STRING(args[1])))
+    {
+        NATIVE_ERROR("pragma() name must be an identifier");
+    }
+    CHECK_CONNECTION(0, "pragma");
+
+    const char* name = AS_CSTRING(args[1]);
+    char* sql;
+    if (argCount == 2)
+        sql = sqlite3_mprintf("PRAGMA %s", name);
+    else if (IS_NUMBER(args[2]))
+        sql = sqlite3_mprintf("PRAGMA %s = %lld", name, (long long)AS_NUMBER(args[2]));
+    else if (IS_STRING(args[2]))
+        sql = sqlite3_mprintf("PRAGMA %s = %Q", name, AS_CSTRING(args[2]));
+    else if (IS_BOOL(args[2]))
+        sql = sqlite3_mprintf("PRAGMA %s = %s", name, AS_BOOL(args[2]) ? "ON" : "OFF");
+    else
+    {
+        NATIVE_ERROR("pragma() value must be a number, string or bool");
+    }
+
+    sqlite3_stmt* stmt = NULL;
+    int rc = sqlite3_prepare_v2(c->db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+        return statementFailed(c, args);
+    }
+
+    args[-1] = NIL_VAL;
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) args[-1] = columnValue(stmt, 0);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return statementFailed(c, args);
+
+    return true;
+}
@@ -6,167 +6,332 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+#define GROUP_WIDTH 16
 
-void initTable(Table* table) 
+// Control bytes. A full slot holds the low 7 bits of its key's hash, so
+// only empty and deleted slots have the sign bit set.
+#define CTRL_EMPTY   ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// A group is GROUP_WIDTH control bytes, matched into a bitmask with one
+// bit per slot.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128i Group;
+
+static inline Group loadGroup(const int8_t* control)
+{
+    return _mm_loadu_si128((const __m128i*)control);
+}
+
+static inline uint32_t matchByte(Group group, int8_t byte)
+{
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+}
+
+static inline uint32_t matchEmptyOrDeleted(Group group)
+{
+    return (uint32_t)_mm_movemask_epi8(group);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+
+typedef int8x16_t Group;
+
+static inline uint32_t toMask(uint8x16_t matches)
+{
+    static const uint8_t bits[GROUP_WIDTH] =
+        { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t masked = vandq_u8(matches, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(masked)) |
+           ((uint32_t)vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+static inline Group loadGroup(const int8_t* control)
+{
+    return vld1q_s8(control);
+}
+
+static inline uint32_t matchByte(Group group, int8_t byte)
+{
+    return toMask(vceqq_s8(group, vdupq_n_s8(byte)));
+}
+
+static inline uint32_t matchEmptyOrDeleted(Group group)
+{
+    return toMask(vcltzq_s8(group));
+}
+
+#else
+
+typedef const int8_t* Group;
+
+static inline Group loadGroup(const int8_t* control)
+{
+    return control;
+}
+
+static inline uint32_t matchByte(Group group, int8_t byte)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (group[i] == byte) mask |= 1u << i;
+    return mask;
+}
+
+static inline uint32_t matchEmptyOrDeleted(Group group)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++)
+        if (group[i] < 0) mask |= 1u << i;
+    return mask;
+}
+
+#endif
+
+static inline int trailingZeros(uint32_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int count = 0;
+    while ((mask & 1) == 0) { mask >>= 1; count++; }
+    return count;
+#endif
+}
+
+static inline int leadingZeros(uint32_t mask)
+{
+    int count = 0;
+    for (uint32_t bit = 1u << (GROUP_WIDTH - 1); bit != 0 && (mask & bit) == 0; bit >>= 1)
+        count++;
+    return count;
+}
+
+#define HASH_POSITION(hash) ((hash) >> 7)
+#define HASH_CONTROL(hash)  ((int8_t)((hash) & 0x7f))
+
+void initTable(Table* table)
 {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
-void freeTable(Table* table) 
+void freeTable(Table* table)
 {
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->control != NULL)
+        FREE_ARRAY(int8_t, table->control, table->capacity + GROUP_WIDTH);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity,
-                        ObjString* key) 
+// The first group is repeated after the last slot so a group can be loaded
+// from any slot without wrapping.
+static void setControl(Table* table, uint32_t index, int8_t control)
 {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+    table->control[index] = control;
+    if (index < GROUP_WIDTH)
+        table->control[table->capacity + index] = control;
+}
 
-    for (;;) 
-    {
-        Entry* entry = &entries[index];
+// Groups are probed at triangular offsets, which visits every group of a
+// power of two sized table. There is always an empty slot, so this ends.
+static Entry* findEntry(Table* table, ObjString* key)
+{
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_POSITION(key->hash) & mask;
+    int8_t control = HASH_CONTROL(key->hash);
 
-        if (entry->key == NULL) 
-        {
-            if (IS_BOOL(entry->value)) 
-            {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            } 
-            else 
-            {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            }
-        } 
-        else if (entry->key == key) 
+    for (uint32_t stride = GROUP_WIDTH; ; stride += GROUP_WIDTH)
+    {
+        Group group = loadGroup(table->control + index);
+        for (uint32_t matches = matchByte(group, control); matches != 0; matches &= matches - 1)
         {
-            // We found the key.
-            return entry;
+            Entry* entry = &table->entries[(index + trailingZeros(matches)) & mask];
+            if (entry->key == key) return entry;
         }
 
-        index = (index + 1) & (capacity - 1);
+        if (matchByte(group, CTRL_EMPTY) != 0) return NULL;
+        index = (index + stride) & mask;
     }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) 
+static uint32_t findInsertSlot(Table* table, uint32_t hash)
+{
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_POSITION(hash) & mask;
+
+    for (uint32_t stride = GROUP_WIDTH; ; stride += GROUP_WIDTH)
+    {
+        uint32_t free = matchEmptyOrDeleted(loadGroup(table->control + index));
+        if (free != 0) return (index + trailingZeros(free)) & mask;
+        index = (index + stride) & mask;
+    }
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
     *value = entry->value;
 
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) 
+// Position of key in the entries array, or -1. Stays valid until the table
+// is resized or the key is deleted.
+int tableGetIndex(Table* table, ObjString* key)
+{
+    if (table->count == 0) return -1;
+
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return -1;
+
+    return (int)(entry - table->entries);
+}
+
+// Rebuilding also drops every tombstone.
+static void adjustCapacity(Table* table, int capacity)
 {
     Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) 
+    for (int i = 0; i < capacity; i++)
     {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
+    int8_t* control = ALLOCATE(int8_t, capacity + GROUP_WIDTH);
+    memset(control, (uint8_t)CTRL_EMPTY, capacity + GROUP_WIDTH);
 
-    table->count = 0;
-    for (int i = 0; i < table->capacity; i++) 
+    Table resized;
+    resized.count = 0;
+    resized.tombstones = 0;
+    resized.capacity = capacity;
+    resized.entries = entries;
+    resized.control = control;
+
+    for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        uint32_t slot = findInsertSlot(&resized, entry->key->hash);
+        setControl(&resized, slot, HASH_CONTROL(entry->key->hash));
+        resized.entries[slot] = *entry;
+        resized.count++;
     }
-    
-    FREE_ARRAY(Entry, table->entries, table->capacity);
 
-    table->entries = entries;
-    table->capacity = capacity;
+    freeTable(table);
+    *table = resized;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) 
+bool tableSet(Table* table, ObjString* key, Value value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) 
+    if (table->count > 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
+        Entry* entry = findEntry(table, key);
+        if (entry != NULL)
+        {
+            entry->value = value;
+            return false;
+        }
+    }
+
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD)
+    {
+        // grow unless clearing out the tombstones makes enough room
+        int capacity = table->capacity;
+        if (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+            capacity = capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity * 2;
         adjustCapacity(table, capacity);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-    entry->key = key;
-    entry->value = value;
+    uint32_t slot = findInsertSlot(table, key->hash);
+    if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+    setControl(table, slot, HASH_CONTROL(key->hash));
 
-    return isNewKey;
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+
+    return true;
 }
 
-bool tableDelete(Table* table, ObjString* key) 
+bool tableDelete(Table* table, ObjString* key)
 {
     if (table->count == 0) return false;
 
-    // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
-    // Place a tombstone in the entry.
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    entry->value = NIL_VAL;
+    table->count--;
+
+    // If every group this slot can be seen in already has an empty slot, no
+    // probe goes past it and it can be empty again. Otherwise it has to stay
+    // as a tombstone so probes keep going.
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = (uint32_t)(entry - table->entries);
+    uint32_t emptyAfter = matchByte(loadGroup(table->control + index), CTRL_EMPTY);
+    uint32_t emptyBefore = matchByte(
+        loadGroup(table->control + ((index - GROUP_WIDTH) & mask)), CTRL_EMPTY);
+
+    if (emptyAfter != 0 && emptyBefore != 0 &&
+        trailingZeros(emptyAfter) + leadingZeros(emptyBefore) < GROUP_WIDTH)
+    {
+        setControl(table, index, CTRL_EMPTY);
+    }
+    else
+    {
+        setControl(table, index, CTRL_DELETED);
+        table->tombstones++;
+    }
     return true;
 }
 
 ObjString* tableFindString(Table* table, const char* chars,
-                           int length, uint32_t hash) 
+                           int length, uint32_t hash)
 {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) 
+    uint32_t mask = table->capacity - 1;
+    uint32_t index = HASH_POSITION(hash) & mask;
+    int8_t control = HASH_CONTROL(hash);
+
+    for (uint32_t stride = GROUP_WIDTH; ; stride += GROUP_WIDTH)
     {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) 
-        {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } 
-        else if (entry->key->length == length &&
-                 entry->key->hash == hash &&
-                 memcmp(entry->key->chars, chars, length) == 0) 
+        Group group = loadGroup(table->control + index);
+        for (uint32_t matches = matchByte(group, control); matches != 0; matches &= matches - 1)
         {
-            // We found it.
-            return entry->key;
+            ObjString* key = table->entries[(index + trailingZeros(matches)) & mask].key;
+            if (key->length == length &&
+                key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0)
+            {
+                return key;
+            }
         }
 
-        index = (index + 1) & (table->capacity - 1);
+        if (matchByte(group, CTRL_EMPTY) != 0) return NULL;
+        index = (index + stride) & mask;
     }
 }
 
-void tableRemoveWhite(Table* table) 
+void markTable(Table* table)
 {
-    for (int i = 0; i < table->capacity; i++) 
-    {
-        Entry* entry = &table->entries[i];
-        
-        if (entry->key != NULL && !entry->key->obj.isMarked) 
-            tableDelete(table, entry->key);
-    }
-}
-
-void markTable(Table* table) 
-{
-    for (int i = 0; i < table->capacity; i++) 
+    for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = &table->entries[i];
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
@@ -9,20 +9,26 @@ typedef struct {
   Value value;
 } Entry;
 
+// Open addressing in the style of Google's SwissTable. Next to the entries
+// is one control byte per slot holding 7 bits of the key's hash, so a probe
+// checks a whole group of slots at once and only compares keys whose bits
+// match. Empty slots always have a NULL key and a nil value.
 typedef struct {
-  int count;
-  int capacity;
+  int count;        // live entries
+  int tombstones;   // deleted slots still blocking probes
+  int capacity;     // 0 or a power of two, at least one group
   Entry* entries;
+  int8_t* control;  // capacity bytes plus a copy of the first group
 } Table;
 
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+int tableGetIndex(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
 void markTable(Table* table);
-void tableRemoveWhite(Table* table);
 
-#endif
\ No newline at end of file
+#endif
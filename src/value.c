@@ -28,6 +28,16 @@ void writeValueArray(ValueArray* array, Value value)
     array->count++;
 }
 
+// Grows the array to hold at least capacity values without reallocating.
+void reserveValueArray(ValueArray* array, int capacity)
+{
+    if (array->capacity >= capacity) return;
+
+    array->values = GROW_ARRAY(Value, array->values,
+                               array->capacity, capacity);
+    array->capacity = capacity;
+}
+
 void freeValueArray(ValueArray* array) 
 {
     FREE_ARRAY(Value, array->values, array->capacity);
@@ -46,22 +56,33 @@ void printValue(Value value)
 
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    if (a == b) return true;
+    return IS_STRING(a) && IS_STRING(b) &&
+           stringsEqual((ObjString*)AS_OBJ(a), (ObjString*)AS_OBJ(b));
+#else
     if (a.type != b.type) return false;
 
     switch (a.type) 
     {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return IS_STRING(a) && IS_STRING(b) &&
+                   stringsEqual((ObjString*)AS_OBJ(a), (ObjString*)AS_OBJ(b));
         case VAL_DATETIME:  return AS_DATETIME(a) == AS_DATETIME(b);
         case VAL_NIL:       return true;
         default:            return false; // Unreachable.
     }
+#endif
 }
 
 int stringifyValue(Value value, char* str, bool escape)
 {
-    switch (value.type)
+    switch (VALUE_TYPE(value))
     {
         case VAL_BOOL:
             return sprintf(str, "%s", AS_BOOL(value) ? "true" : "false");
@@ -71,6 +92,8 @@ int stringifyValue(Value value, char* str, bool escape)
             return stringifyObject(value, str, escape);
         case VAL_NIL:
             return sprintf(str, "%s", "null");
+        case VAL_UNDEFINED:
+            return sprintf(str, "%s", "undefined");
         case VAL_DATETIME: {
             time_t t = AS_DATETIME(value);
             struct tm *tm = localtime(&t);
@@ -83,7 +106,7 @@ int stringifyValue(Value value, char* str, bool escape)
 
 int stringifyValueLength(Value value, bool escape)
 {
-    switch (value.type)
+    switch (VALUE_TYPE(value))
     {
         case VAL_BOOL:
             return AS_BOOL(value) ? 4 : 5;
@@ -95,6 +118,8 @@ int stringifyValueLength(Value value, bool escape)
             return stringifyObjectLength(value, escape);
         case VAL_NIL:
             return 4;
+        case VAL_UNDEFINED:
+            return 9;
         case VAL_DATETIME: {
             time_t t = AS_DATETIME(value);
             struct tm *tm = localtime(&t);
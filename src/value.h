@@ -12,9 +12,81 @@ typedef enum {
     VAL_BOOL,
     VAL_NUMBER,
     VAL_DATETIME,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED // marks an unassigned global slot, never visible to scripts
 } ValueType;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// Numbers are stored as plain doubles. Everything else lives inside the quiet
+// NaN space: objects set the sign bit and keep their pointer in the low 48
+// bits, datetimes set DATETIME_BIT and keep a 48-bit time_t, and nil/false/true
+// are small tags in the low bits.
+#define SIGN_BIT        ((uint64_t)0x8000000000000000)
+#define QNAN            ((uint64_t)0x7ffc000000000000)
+#define DATETIME_BIT    ((uint64_t)0x0002000000000000)
+#define PAYLOAD_MASK    ((uint64_t)0x0000ffffffffffff)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_DATETIME(value)  \
+    (((value) & (SIGN_BIT | QNAN | DATETIME_BIT)) == (QNAN | DATETIME_BIT))
+#define IS_OBJ(value)       (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)      ((value) == TRUE_VAL)
+#define AS_NUMBER(value)    valueToNum(value)
+#define AS_DATETIME(value)  ((time_t)(((int64_t)((value) << 16)) >> 16))
+#define AS_OBJ(value)       ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)         ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL           ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL            ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NUMBER_VAL(num)     numToValue(num)
+#define DATETIME_VAL(t)     \
+    ((Value)(QNAN | DATETIME_BIT | ((uint64_t)(t) & PAYLOAD_MASK)))
+#define OBJ_VAL(obj)        ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
+#define NIL_VAL             ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL       ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+static inline double valueToNum(Value value)
+{
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num)
+{
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+static inline ValueType valueType(Value value)
+{
+    if (IS_NUMBER(value)) return VAL_NUMBER;
+    if (IS_OBJ(value)) return VAL_OBJ;
+    if (IS_DATETIME(value)) return VAL_DATETIME;
+    if (IS_NIL(value)) return VAL_NIL;
+    if (IS_UNDEFINED(value)) return VAL_UNDEFINED;
+    return VAL_BOOL;
+}
+
+#define VALUE_TYPE(value)   valueType(value)
+
+#else
+
 typedef struct {
     ValueType type;
     union {
@@ -30,6 +102,7 @@ typedef struct {
 #define IS_DATETIME(value)  ((value).type == VAL_DATETIME)
 #define IS_OBJ(value)       ((value).type == VAL_OBJ)
 #define IS_NIL(value)       ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)      ((value).as.boolean)
 #define AS_NUMBER(value)    ((value).as.number)
@@ -41,6 +114,11 @@ typedef struct {
 #define DATETIME_VAL(value) ((Value){VAL_DATETIME, {.datetime = value}})
 #define OBJ_VAL(object)     ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 #define NIL_VAL             ((Value){VAL_NIL, {.number = 0}})           
+#define UNDEFINED_VAL       ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#define VALUE_TYPE(value)   ((value).type)
+
+#endif
 
 typedef struct {
     int capacity;
@@ -50,6 +128,7 @@ typedef struct {
 
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
+void reserveValueArray(ValueArray* array, int capacity);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
 bool valuesEqual(Value a, Value b);
@@ -5,11 +5,12 @@
 #include <stdlib.h>
 #include <math.h>
 
-#include "quicksort.h"
+#include "sort.h"
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
+#include "cache.h"
 #include "memory.h"
 #include "object.h"
 #include "format.h"
@@ -21,6 +22,7 @@
 #include "native/date.h"
 #include "native/native.h"
 #include "native/mathmod.h"
+#include "native/gcmod.h"
 #include "native/jsonparse.h"
 #include "sqlite3/sql.h"
 
@@ -36,7 +38,7 @@ VM vm;
 
 static bool typeNative(int argCount, Value* args)
 {
-    int t = args[0].type;
+    int t = VALUE_TYPE(args[0]);
     if (t == VAL_OBJ)
     {
         t = t + AS_OBJ(args[0])->type;
@@ -53,15 +55,54 @@ static bool sleepNative(int argCount, Value* args)
     return true;
 }
 
-static bool sortNative(int argCount, Value* args)
+// sortlist(list) sorts the list in place, sortlist(list, keys) orders it by
+// the matching keys instead. sort() in the core library is built on this.
+static bool sortlistNative(int argCount, Value* args)
 {
+    if (argCount != 1 && argCount != 2)
+    {
+        NATIVE_ERROR("sortlist expects a list and optionally a list of keys.");
+    }
     CHECK_LIST(0, "Only lists can be sorted.");
     ObjList* list = AS_LIST(args[0]);
-    sort(&list->elements);
+
+    if (argCount == 2)
+    {
+        CHECK_LIST(1, "Sort keys must be a list.");
+        ObjList* keys = AS_LIST(args[1]);
+        if (keys->elements.count != list->elements.count)
+        {
+            NATIVE_ERROR("There must be one sort key for each item.");
+        }
+        sortValuesByKeys(&list->elements, &keys->elements);
+    }
+    else
+    {
+        sortValues(&list->elements);
+    }
+
     args[-1] = args[0];
     return true;
 }
 
+// sortthreads(n) sets how many threads sort long lists, 0 meaning one per
+// core, and returns the count now in use. sortthreads() just returns it.
+static bool sortthreadsNative(int argCount, Value* args)
+{
+    if (argCount > 1)
+    {
+        NATIVE_ERROR("sortthreads expects at most one parameter.");
+    }
+    if (argCount == 1)
+    {
+        CHECK_NUM(0, "sortthreads expects a number of threads.");
+        setSortThreads((int)AS_NUMBER(args[0]));
+    }
+
+    args[-1] = NUMBER_VAL(getSortThreads());
+    return true;
+}
+
 static bool numNative(int argCount, Value* args)
 {
     CHECK_STRING(0, "num expects a string as parameter.");
@@ -78,8 +119,22 @@ static bool numNative(int argCount, Value* args)
     return true;
 }
 
+#ifndef _WIN32
+static struct timespec startTime;
+#endif
+
+// Seconds since the VM started. clock() is CPU time summed over every
+// thread, which can't time work spread across threads, so a monotonic
+// clock is used where there is one.
 static bool clockNative(int argCount, Value* args) {
+#ifdef _WIN32
     args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    args[-1] = NUMBER_VAL((double)(now.tv_sec - startTime.tv_sec) +
+                          (now.tv_nsec - startTime.tv_nsec) / 1e9);
+#endif
     return true;
 }
 
@@ -122,6 +177,7 @@ static bool argsNative(int argCount, Value* args) {
             Value val =OBJ_VAL(copyStringRaw(_args[i], (int)strlen(_args[i])));
             push(val);
             writeValueArray(&list->elements, val);
+            WRITE_BARRIER(list, val);
             pop();
         }
     }
@@ -169,33 +225,53 @@ static void runtimeError(const char* format, ...)
     resetStack();
 }
 
+// Globals live in a flat array; the compiler resolves each name to its index
+// once, and the slot stays UNDEFINED_VAL until the global is defined.
+int globalSlot(ObjString* name)
+{
+    Value index;
+    if (tableGet(&vm.globalSlots, name, &index))
+        return (int)AS_NUMBER(index);
+
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)slot));
+    pop();
+    return slot;
+}
+
 static void defineNative(const char* name, NativeFn function, int arity) 
 {
-    push(OBJ_VAL(copyStringRaw(name, (int)strlen(name))));
+    push(OBJ_VAL(internString(copyStringRaw(name, (int)strlen(name)))));
     push(OBJ_VAL(newNative(function, arity)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
 static void defineNativeMod(const char* name, const char* module,  NativeFn function, int arity) 
 {
-    Value value;
     //stack: 0 = module name, 1 = module, 2 = function name, 3 = navtive function 
-    push(OBJ_VAL(copyStringRaw(module, (int)strlen(module)))); 
-    if (!tableGet(&vm.globals, AS_STRING(vm.stack[0]), &value)) 
+    push(OBJ_VAL(internString(copyStringRaw(module, (int)strlen(module))))); 
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    if (IS_UNDEFINED(vm.globalValues.values[slot])) 
     {   
         push(OBJ_VAL(newMod(AS_STRING(vm.stack[0]))));
-        tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+        vm.globalValues.values[slot] = vm.stack[1];
     }
     else
     {
-        push(value);
+        push(vm.globalValues.values[slot]);
     }
     ObjClass* klass = AS_CLASS(vm.stack[1]);
-    push(OBJ_VAL(copyStringRaw(name, (int)strlen(name))));
+    push(OBJ_VAL(internString(copyStringRaw(name, (int)strlen(name)))));
     push(OBJ_VAL(newNative(function, arity)));
     tableSet(&klass->methods, AS_STRING(vm.stack[2]), vm.stack[3]);
+    WRITE_BARRIER(klass, vm.stack[2]);
+    WRITE_BARRIER(klass, vm.stack[3]);
     pop();
     pop();
     pop();
@@ -204,24 +280,48 @@ static void defineNativeMod(const char* name, const char* module,  NativeFn func
 
 void initVM() 
 {
+#ifndef _WIN32
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+#endif
     resetStack();
     vm.objects = NULL;
+    vm.oldObjects = NULL;
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.nurseryBytes = 0;
+    vm.gcState = GC_IDLE;
+    vm.gcIncremental = false;
+    vm.markBit = true;
+    vm.sweepLink = NULL;
+    vm.stepBytes = 0;
+    vm.gcBudget = CLOCKS_PER_SEC / 1000;
+    vm.gcMaxPause = 0;
+    vm.gcCount = 0;
+    vm.gcMinorCount = 0;
 
     initTable(&vm.strings);
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
     vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    vm.initString = internString(copyString("init", 4));
 
-    vm.whereString = NULL;
-    vm.whereString = copyString("filter", 6);
+    for (int i = 0; i < UINT8_COUNT; i++)
+        vm.charStrings[i] = NULL;
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        char c = (char)i;
+        vm.charStrings[i] = internString(copyStringRaw(&c, 1));
+    }
 
-    vm.selectString = NULL;
-    vm.selectString = copyString("map", 3);
+    vm.whereSlot = globalSlot(internString(copyString("filter", 6)));
+    vm.selectSlot = globalSlot(internString(copyString("map", 3)));
 
     // Native Functions (global namespace)
     defineNative("sleep", sleepNative, 1);
@@ -230,11 +330,15 @@ void initVM()
     defineNative("rand", randNative, 1);
     defineNative("num", numNative, 1);   
     defineNative("type", typeNative, 1);
-    defineNative("sort", sortNative, 1);
+    defineNative("sortlist", sortlistNative, -1);
+    defineNative("sortthreads", sortthreadsNative, -1);
     defineNative("len", lenNative, 1);
+    defineNative("remove", removeNative, 2);
+    defineNative("reserve", reserveNative, 2);
     defineNative("~range", rangeNative, 3);
     defineNative("fromjson", jsonNative, 1);
     defineNative("query", queryNative, -1);
+    defineNative("~cursor", cursorNative, -1);
     defineNative("setdb", setdbNative, 1);
 
     // STRING
@@ -293,15 +397,34 @@ void initVM()
     defineNativeMod("close", "file", closeNative, 1);
     defineNativeMod("write", "file", writeFileNative, 2);
     defineNativeMod("readchar", "file", readcharNative, 1);
+
+    // GC
+    defineNativeMod("collect", "gc", collectNative, 0);
+    defineNativeMod("incremental", "gc", incrementalNative, 1);
+    defineNativeMod("budget", "gc", budgetNative, 1);
+    defineNativeMod("stats", "gc", statsNative, 0);
+
+    // DB
+    defineNativeMod("open", "db", dbopenNative, 1);
+    defineNativeMod("close", "db", dbcloseNative, 1);
+    defineNativeMod("use", "db", useNative, 1);
+    defineNativeMod("query", "db", dbqueryNative, -1);
+    defineNativeMod("attach", "db", attachNative, 3);
+    defineNativeMod("pragma", "db", pragmaNative, -1);
+    defineNativeMod("batch", "db", batchNative, 2);
+    defineNativeMod("cachesize", "db", cachesizeNative, 1);
+    defineNativeMod("reuserows", "db", reuserowsNative, 1);
+    defineNativeMod("stats", "db", dbstatsNative, 0);
     
 }
 
 void freeVM() 
 {
-    freeTable(&vm.globals);
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
     freeTable(&vm.strings);
     vm.initString = NULL;
-    vm.whereString = NULL;
     freeObjects();
 }
 
@@ -404,7 +527,7 @@ static bool callValue(Value callee, int argCount)
                 } 
                 else 
                 {
-                    runtimeError(AS_STRING(vm.stackTop[-argCount - 1])->chars);
+                    runtimeError("%s", AS_CSTRING(vm.stackTop[-argCount - 1]));
                     return false;
                 }
             }
@@ -481,7 +604,7 @@ static bool invoke(ObjString* name, int argCount)
     ObjInstance* instance = AS_INSTANCE(receiver);
 
     Value value;
-    if (tableGet(&instance->fields, name, &value)) 
+    if (getField(instance, name, &value)) 
     {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
@@ -489,19 +612,124 @@ static bool invoke(ObjString* name, int argCount)
     return invokeFromClass(instance->klass, name, argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) 
+static void updateCache(InlineCache* cache, ObjClass* klass, Shape* shape,
+                        Shape* transition, int index, Value method)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+    // most recent receiver first, the oldest one drops off the end
+    memmove(&cache->entries[1], &cache->entries[0],
+        sizeof(CacheEntry) * (INLINE_CACHE_ENTRIES - 1));
+    cache->entries[0].klass = klass;
+    cache->entries[0].shape = shape;
+    cache->entries[0].transition = transition;
+    cache->entries[0].index = index;
+    cache->entries[0].method = method;
+
+    // the cache belongs to the function that is running
+    ObjFunction* function = vm.frames[vm.frameCount - 1].closure->function;
+    WRITE_BARRIER(function, OBJ_VAL(klass));
+    WRITE_BARRIER(function, method);
+}
+
+// Finds name on the instance through the site's cache, falling back to the
+// shape and the method table on a miss. Returns false if the property is missing.
+static bool lookupCached(ObjInstance* instance, ObjString* name, InlineCache* cache,
+                         Value* value, bool* isField)
+{
+    Shape* shape = instance->shape;
+
+    if (shape == NULL)
+    {
+        // too many fields for a shape, nothing to cache
+        *isField = tableGet(&instance->fields, name, value);
+        return *isField || tableGet(&instance->klass->methods, name, value);
+    }
+
+    for (int i = 0; i < INLINE_CACHE_ENTRIES; i++)
+    {
+        CacheEntry* entry = &cache->entries[i];
+        if (entry->shape != shape || entry->transition != NULL) continue;
+
+        *isField = entry->index >= 0;
+        *value = *isField ? instance->slots[entry->index] : entry->method;
+        return true;
+    }
+
+    int slot = shapeSlot(shape, name);
+    if (slot != -1)
+    {
+        updateCache(cache, instance->klass, shape, NULL, slot, NIL_VAL);
+        *value = instance->slots[slot];
+        *isField = true;
+        return true;
+    }
+
+    if (!tableGet(&instance->klass->methods, name, value))
+        return false;
+
+    updateCache(cache, instance->klass, shape, NULL, -1, *value);
+    *isField = false;
+    return true;
+}
+
+static void setFieldCached(ObjInstance* instance, ObjString* name, InlineCache* cache, Value value)
+{
+    Shape* shape = instance->shape;
+
+    if (shape != NULL)
+    {
+        for (int i = 0; i < INLINE_CACHE_ENTRIES; i++)
+        {
+            CacheEntry* entry = &cache->entries[i];
+            if (entry->shape != shape) continue;
+
+            if (entry->transition == NULL)
+            {
+                instance->slots[entry->index] = value;
+                WRITE_BARRIER(instance, value);
+            }
+            else
+                setFieldSlot(instance, entry->transition, entry->index, value);
+            return;
+        }
+    }
+
+    setField(instance, name, value);
+
+    if (shape == NULL || instance->shape == NULL) return;
+
+    // cache either the slot that was overwritten or the transition just taken
+    Shape* transition = instance->shape != shape ? instance->shape : NULL;
+    int slot = shapeSlot(instance->shape, name);
+    updateCache(cache, instance->klass, shape, transition, slot, NIL_VAL);
+}
+
+static bool invokeCached(ObjString* name, int argCount, InlineCache* cache)
+{
+    Value receiver = peek(argCount);
+    if (!IS_INSTANCE(receiver))
+        return invoke(name, argCount);
+
+    Value value;
+    bool isField;
+    if (!lookupCached(AS_INSTANCE(receiver), name, cache, &value, &isField))
+    {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod* bound = newBoundMethod(peek(0),
-                                            AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
-    return true;
+    if (isField)
+    {
+        vm.stackTop[-argCount - 1] = value;
+        return callValue(value, argCount);
+    }
+
+    if (IS_CLOSURE(value))
+        return call(AS_CLOSURE(value), argCount);
+    else if (IS_NATIVE(value))
+        return callValue(value, argCount);
+
+    runtimeError("Not a valid function");
+    return false;
 }
 
 static ObjUpvalue* captureUpvalue(Value* local) 
@@ -537,6 +765,7 @@ static void closeUpvalues(Value* last)
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        WRITE_BARRIER(upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -546,6 +775,8 @@ static void defineMethod(ObjString* name)
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    WRITE_BARRIER(klass, OBJ_VAL(name));
+    WRITE_BARRIER(klass, method);
     pop();
 }
 
@@ -558,6 +789,7 @@ static void defineEnumField(ObjString* name)
     //printf("Defining enum field: %s\n", name->chars);
     
     tableSet(&_enum->fields, name, val);
+    WRITE_BARRIER(_enum, OBJ_VAL(name));
     _enum->counter++;
 }
 
@@ -570,6 +802,8 @@ static void setEnumField(ObjString* name)
     //printf("Defining enum field: %s\n", name->chars);
     
     tableSet(&_enum->fields, name, val);
+    WRITE_BARRIER(_enum, OBJ_VAL(name));
+    WRITE_BARRIER(_enum, val);
 
     if(IS_NUMBER(val))
     {
@@ -587,16 +821,10 @@ static bool isFalsey(Value value)
 
 static void concatenate() 
 {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    ObjString* b = (ObjString*)AS_OBJ(peek(0));
+    ObjString* a = (ObjString*)AS_OBJ(peek(1));
 
-    ObjString* result = takeString(chars, length);
+    ObjString* result = concatenateStrings(a, b);
     pop();
     pop();
     push(OBJ_VAL(result));
@@ -607,12 +835,15 @@ static void concatenateList()
 
     ObjList* b = AS_LIST(peek(0));
     ObjList* a = AS_LIST(peek(1));
+
+    // allocate the elements before the list so a collection can't promote
+    // the list while it is still empty
+    int length = a->elements.count + b->elements.count;
+    Value* values = ALLOCATE(Value, length);
     ObjList* result = newList();
 
     push(OBJ_VAL(result));
 
-    int length = a->elements.count + b->elements.count;
-    Value* values = ALLOCATE(Value, length);
     result->elements.capacity = length;
     result->elements.count = length;
 
@@ -656,15 +887,16 @@ static bool setList(Value listVal, Value item, Value index)
         return false;
     }
     list->elements.values[i] = item;
+    WRITE_BARRIER(list, item);
 
     return true;
 }
 
 bool setTable(Value tableVal, Value item, Value index)
 {
-    if (!IS_STRING(index))
+    if (!IS_TABLE_KEY(index))
     {
-        runtimeError("Index must be a string");
+        runtimeError("Index must be a string, number, date or bool");
         return false;
     }
 
@@ -674,12 +906,16 @@ bool setTable(Value tableVal, Value item, Value index)
         return false;
     }
 
-    ObjString* key = AS_STRING(index);
+    if (IS_STRING(index))
+        index = OBJ_VAL(internString(AS_STRING(index)));
+    push(index);
 
     ObjTable* table = AS_TABLE(tableVal);   
 
-    if (tableSet(&table->elements, key, item))
-        writeValueArray(&table->keys, index); // only add to list of keys if it's a new entry
+    setTableValue(table, index, item);
+    WRITE_BARRIER(table, index);
+    WRITE_BARRIER(table, item);
+    pop();
 
     return true;
 }
@@ -716,17 +952,32 @@ Value get(Value item, Value index, bool* hasError)
     {
         Value result;
         ObjTable* table = AS_TABLE(item);
-        if (!IS_STRING(index))
+        if (!IS_TABLE_KEY(index))
         {
-            runtimeError("Index of a table must be a string");
+            runtimeError("Index of a table must be a string, number, date or bool");
             *hasError = true;
             return NIL_VAL;
         }
-        ObjString* key = AS_STRING(index);
-        bool keyFound = tableGet(&table->elements, key, &result);
+        // string keys are interned, so a string that isn't can't be one
+        Value key = index;
+        if (IS_STRING(index))
+        {
+            ObjString* interned = findInternedString(AS_STRING(index));
+            key = interned == NULL ? NIL_VAL : OBJ_VAL(interned);
+        }
+        bool keyFound = !IS_NIL(key) && getTableValue(table, key, &result);
         if (!keyFound)
         {
-            runtimeError("Key '%s' not found in table", AS_CSTRING(index));
+            if (IS_STRING(index))
+            {
+                runtimeError("Key '%s' not found in table", AS_CSTRING(index));
+            }
+            else
+            {
+                char name[64];
+                stringifyValue(index, name, false);
+                runtimeError("Key '%s' not found in table", name);
+            }
             *hasError = true;
             return NIL_VAL;
         }
@@ -750,7 +1001,7 @@ Value get(Value item, Value index, bool* hasError)
             *hasError = true;
             return NIL_VAL;
         }
-        return OBJ_VAL(copyStringRaw(string->chars + i, 1));
+        return OBJ_VAL(CHAR_STRING(string->chars[i]));
     }
     
 }
@@ -782,6 +1033,7 @@ Value slice(Value item, Value startIndex, Value endIndex)
         for(int i = start; i < end; i++)
         {
             writeValueArray(&sliced->elements, list->elements.values[i]);
+            WRITE_BARRIER(sliced, list->elements.values[i]);
         }   
         pop(); 
 
@@ -798,6 +1050,7 @@ Value slice(Value item, Value startIndex, Value endIndex)
             return NIL_VAL;
         }
         if (start > end) start = end;
+        if (end - start == 1) return OBJ_VAL(CHAR_STRING(string->chars[start]));
         return OBJ_VAL(copyStringRaw(string->chars + start, end - start));
     }
 }
@@ -811,9 +1064,9 @@ static bool incDecProperty(ObjString* propName, double amount)
     }
 
     ObjInstance* instance = AS_INSTANCE(peek(0));
-    Value val;
+    Value val = NIL_VAL;
 
-    tableGet(&instance->fields, propName, &val);
+    getField(instance, propName, &val);
     if(!IS_NUMBER(val))
     {
         runtimeError("Property must be a number");
@@ -821,9 +1074,9 @@ static bool incDecProperty(ObjString* propName, double amount)
     }
 
     Value value = val;
-    AS_NUMBER(val) += amount;
+    val = NUMBER_VAL(AS_NUMBER(val) + amount);
 
-    tableSet(&instance->fields, propName, val);
+    setField(instance, propName, val);
     pop();
     push(value);
 
@@ -834,21 +1087,17 @@ static Value addValues(Value val1, Value val2)
 {
     if (IS_STRING(val1) && IS_STRING(val2)) 
     {
-        ObjString* a = AS_STRING(val1);
-        ObjString* b = AS_STRING(val2);
-        int length = a->length + b->length;
-        char* chars = ALLOCATE(char, length + 1);
-        memcpy(chars, a->chars, a->length);
-        memcpy(chars + a->length, b->chars, b->length);
-        chars[length] = '\0';
-
-        return OBJ_VAL(takeString(chars, length));
+        ObjString* a = (ObjString*)AS_OBJ(val1);
+        ObjString* b = (ObjString*)AS_OBJ(val2);
+        return OBJ_VAL(concatenateStrings(a, b));
     } 
     else if (IS_LIST(val1) && IS_LIST(val2)) 
     {
         //printf("attempting to add list\n");
         ObjList* a = AS_LIST(val1);
         ObjList* b = AS_LIST(val2);
+        int length = a->elements.count + b->elements.count;
+        Value* values = ALLOCATE(Value, length);
         ObjList* result = newList();
 
         //printf("next line is val2\n--------\n");
@@ -858,10 +1107,8 @@ static Value addValues(Value val1, Value val2)
         push(OBJ_VAL(result));
         //printf("added list to stack\n");
 
-        int length = a->elements.count + b->elements.count;
         //printf("length a:%d length b:%d", a->elements.count, b->elements.count );
         //printf("length: %d", length);
-        Value* values = ALLOCATE(Value, length);
         result->elements.capacity = length;
         result->elements.count = length;
 
@@ -902,16 +1149,16 @@ static bool addProperty(ObjString* propName)
     }
 
     ObjInstance* instance = AS_INSTANCE(peek(1));
-    Value val;
+    Value val = NIL_VAL;
 
-    tableGet(&instance->fields, propName, &val);
+    getField(instance, propName, &val);
 
     Value newValue = addValues(val, amount);
     if (IS_NIL(newValue))
         return false;
     pop();
 
-    tableSet(&instance->fields, propName, newValue);
+    setField(instance, propName, newValue);
     pop();
     push(newValue);
 
@@ -979,7 +1226,7 @@ static bool incSubscript()
         return false;
     pop();
     push(value);
-    AS_NUMBER(value) += AS_NUMBER(incBy);
+    value = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(incBy));
     //if (!set(list, value, index))
     //    return false;
 
@@ -1030,9 +1277,11 @@ static InterpretResult run()
             } \
             else if (IS_STRING(peek(0)) && IS_STRING(peek(1))) \
             { \
-                char* b = AS_CSTRING(pop()); \
-                char* a = AS_CSTRING(pop()); \
+                char* b = AS_CSTRING(peek(0)); \
+                char* a = AS_CSTRING(peek(1)); \
                 int result = strcmp(a, b); \
+                pop(); \
+                pop(); \
                 push(valueType(result op 0)); \
             } \
             else \
@@ -1074,7 +1323,7 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR; \
             } \
             push(val); \
-            AS_NUMBER(val) += (double)number; \
+            val = NUMBER_VAL(AS_NUMBER(val) + (double)number); \
             value = val; \
         } while (false)
 /*
@@ -1108,8 +1357,90 @@ static InterpretResult run()
         } while (false)
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
+    #define READ_CACHE() (&frame->closure->function->caches[READ_SHORT()])
+
+#ifdef COMPUTED_GOTO
+    // Each handler jumps straight to the next one instead of going back through
+    // the switch, so every opcode gets its own indirect branch to predict.
+    static void* dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_T_MAX]     = &&op_unknown,
+        [OP_CONSTANT]           = &&op_OP_CONSTANT,
+        [OP_TRUE]               = &&op_OP_TRUE,
+        [OP_FALSE]              = &&op_OP_FALSE,
+        [OP_NIL]                = &&op_OP_NIL,
+        [OP_EQUAL]              = &&op_OP_EQUAL,
+        [OP_GREATER]            = &&op_OP_GREATER,
+        [OP_LESS]               = &&op_OP_LESS,
+        [OP_ADD]                = &&op_OP_ADD,
+        [OP_SUBTRACT]           = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY]           = &&op_OP_MULTIPLY,
+        [OP_DIVIDE]             = &&op_OP_DIVIDE,
+        [OP_MOD]                = &&op_OP_MOD,
+        [OP_NOT]                = &&op_OP_NOT,
+        [OP_NEGATE]             = &&op_OP_NEGATE,
+        [OP_PRINT]              = &&op_OP_PRINT,
+        [OP_JUMP_IF_FALSE]      = &&op_OP_JUMP_IF_FALSE,
+        [OP_JUMP]               = &&op_OP_JUMP,
+        [OP_LOOP]               = &&op_OP_LOOP,
+        [OP_CALL]               = &&op_OP_CALL,
+        [OP_POP]                = &&op_OP_POP,
+        [OP_DEFINE_GLOBAL]      = &&op_OP_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL]         = &&op_OP_GET_GLOBAL,
+        [OP_SUBSCRIPT]          = &&op_OP_SUBSCRIPT,
+        [OP_SUBSCRIPT_SET]      = &&op_OP_SUBSCRIPT_SET,
+        [OP_SUBSCRIPT_INC]      = &&op_OP_SUBSCRIPT_INC,
+        [OP_SUBSCRIPT_ADD]      = &&op_OP_SUBSCRIPT_ADD,
+        [OP_SLICE]              = &&op_OP_SLICE,
+        [OP_SET_GLOBAL]         = &&op_OP_SET_GLOBAL,
+        [OP_GET_LOCAL]          = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL]          = &&op_OP_SET_LOCAL,
+        [OP_CLOSURE]            = &&op_OP_CLOSURE,
+        [OP_GET_UPVALUE]        = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]        = &&op_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE]      = &&op_OP_CLOSE_UPVALUE,
+        [OP_NEW_LIST]           = &&op_OP_NEW_LIST,
+        [OP_LIST_ADD]           = &&op_OP_LIST_ADD,
+        [OP_NEW_TABLE]          = &&op_OP_NEW_TABLE,
+        [OP_TABLE_ADD]          = &&op_OP_TABLE_ADD,
+        [OP_FORMAT]             = &&op_OP_FORMAT,
+        [OP_RANGE]              = &&op_OP_RANGE,
+        [OP_JOIN]               = &&op_OP_JOIN,
+        [OP_RETURN]             = &&op_OP_RETURN,
+        [OP_INC_LOCAL]          = &&op_OP_INC_LOCAL,
+        [OP_INC_UPVALUE]        = &&op_OP_INC_UPVALUE,
+        [OP_INC_PROPERTY]       = &&op_OP_INC_PROPERTY,
+        [OP_DEC_LOCAL]          = &&op_OP_DEC_LOCAL,
+        [OP_DEC_UPVALUE]        = &&op_OP_DEC_UPVALUE,
+        [OP_DEC_PROPERTY]       = &&op_OP_DEC_PROPERTY,
+        [OP_ADD_LOCAL]          = &&op_OP_ADD_LOCAL,
+        [OP_ADD_UPVALUE]        = &&op_OP_ADD_UPVALUE,
+        [OP_ADD_PROPERTY]       = &&op_OP_ADD_PROPERTY,
+        [OP_CLASS]              = &&op_OP_CLASS,
+        [OP_MODULE]             = &&op_OP_MODULE,
+        [OP_GET_PROPERTY]       = &&op_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY]       = &&op_OP_SET_PROPERTY,
+        [OP_METHOD]             = &&op_OP_METHOD,
+        [OP_INVOKE]             = &&op_OP_INVOKE,
+        [OP_WHERE]              = &&op_OP_WHERE,
+        [OP_SELECT]             = &&op_OP_SELECT,
+        [OP_POP_LIST]           = &&op_OP_POP_LIST,
+        [OP_ENUM]               = &&op_OP_ENUM,
+        [OP_ENUM_FIELD]         = &&op_OP_ENUM_FIELD,
+        [OP_ENUM_FIELD_SET]     = &&op_OP_ENUM_FIELD_SET,
+        [OP_FOR_ITER]           = &&op_OP_FOR_ITER,
+        [OP_RANGE_BOUND]        = &&op_OP_RANGE_BOUND,
+        [OP_FOR_RANGE]          = &&op_OP_FOR_RANGE,
+        [OP_CLOSE_ITER]         = &&op_OP_CLOSE_ITER,
+    };
+
+    #define CASE(op) case op: op_##op
+    #define DISPATCH() goto *dispatchTable[instruction = READ_BYTE()]
+#else
+    #define CASE(op) case op
+    #define DISPATCH() break
+#endif
 
-    for (;;) 
+    for (;;)
     {
         #ifdef DEBUG_TRACE_EXECUTION
             printf("          ");
@@ -1127,23 +1458,23 @@ static InterpretResult run()
         uint8_t instruction;
         switch (instruction = READ_BYTE()) 
         {
-            case OP_CONSTANT: {
+            CASE(OP_CONSTANT): {
                 Value constant = READ_CONSTANT();
                 push(constant);
-                break;
+                DISPATCH();
             }
-            case OP_NIL:        push(NIL_VAL); break;
-            case OP_TRUE:       push(BOOL_VAL(true)); break;
-            case OP_FALSE:      push(BOOL_VAL(false)); break;
-            case OP_EQUAL: {
+            CASE(OP_NIL):        push(NIL_VAL); DISPATCH();
+            CASE(OP_TRUE):       push(BOOL_VAL(true)); DISPATCH();
+            CASE(OP_FALSE):      push(BOOL_VAL(false)); DISPATCH();
+            CASE(OP_EQUAL): {
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+                DISPATCH();
             }
-            case OP_GREATER:    COMPARE_OP(BOOL_VAL, >); break;
-            case OP_LESS:       COMPARE_OP(BOOL_VAL, <); break;
-            case OP_ADD:        
+            CASE(OP_GREATER):    COMPARE_OP(BOOL_VAL, >); DISPATCH();
+            CASE(OP_LESS):       COMPARE_OP(BOOL_VAL, <); DISPATCH();
+            CASE(OP_ADD):        
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) 
                 {
                     concatenate();
@@ -1164,76 +1495,83 @@ static InterpretResult run()
                     runtimeError("Operands must be of the same type.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
-            case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
-            case OP_MOD:        BINARY_OP_INT(NUMBER_VAL, %); break;
-            case OP_NOT:
+                DISPATCH();
+            CASE(OP_SUBTRACT):   BINARY_OP(NUMBER_VAL, -); DISPATCH();
+            CASE(OP_MULTIPLY):   BINARY_OP(NUMBER_VAL, *); DISPATCH();
+            CASE(OP_DIVIDE):     BINARY_OP(NUMBER_VAL, /); DISPATCH();
+            CASE(OP_MOD):        BINARY_OP_INT(NUMBER_VAL, %); DISPATCH();
+            CASE(OP_NOT):
                 push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:   
+                DISPATCH();
+            CASE(OP_NEGATE):   
                 if (!IS_NUMBER(peek(0))) {
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT: {
-                printValue(pop());
+                DISPATCH();
+            CASE(OP_PRINT): {
+                printValue(peek(0));
+                pop();
                 printf("\n");
-                break;
+                DISPATCH();
             }
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
+            CASE(OP_POP): pop(); DISPATCH();
+            CASE(OP_GET_LOCAL): {
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
-                break;
+                DISPATCH();
             }
-            case OP_SET_LOCAL: {
+            CASE(OP_SET_LOCAL): {
                 uint8_t slot = READ_BYTE();
                 frame->slots[slot] = peek(0);
-                break;
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if(tableGet(&vm.globals, name, &value))
+            CASE(OP_DEFINE_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                if (!IS_UNDEFINED(vm.globalValues.values[slot]))
                 {
-                    runtimeError("A global variable or function called '%s' already exists.", name->chars);
+                    runtimeError("A global variable or function called '%s' already exists.", 
+                        AS_CSTRING(vm.globalNames.values[slot]));
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                tableSet(&vm.globals, name, peek(0));
+                vm.globalValues.values[slot] = peek(0);
                 pop();
-                break;
+                DISPATCH();
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) 
+            CASE(OP_GET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                Value value = vm.globalValues.values[slot];
+                if (IS_UNDEFINED(value)) 
                 {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_SUBSCRIPT: {
+            CASE(OP_SUBSCRIPT): {
                 
-                Value index = pop();
-                Value item = pop();
+                // a rope index or string is flattened by get, so both stay
+                // on the stack until then
+                Value index = peek(0);
+                Value item = peek(1);
                 bool hasError = false;
                 Value result = get(item, index, &hasError);
                 if (hasError) return INTERPRET_RUNTIME_ERROR;
+                pop();
+                pop();
                 push(result);
 
-                break;
+                DISPATCH();
             }
-            case OP_SUBSCRIPT_SET: {
+            CASE(OP_SUBSCRIPT_SET): {
                 
-                Value value = pop();
-                Value index = pop();
-                Value target = peek(0);
+                // value and index stay on the stack until stored, in case
+                // growing the table collects
+                Value value = peek(0);
+                Value index = peek(1);
+                Value target = peek(2);
                 if (IS_LIST(target))
                 {
                     if (!setList(target, value, index))
@@ -1249,16 +1587,17 @@ static InterpretResult run()
                     runtimeError("Invalid subscript target");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                //pop();
+                pop();
+                pop();
 
-                break;
+                DISPATCH();
             }
-            case OP_SUBSCRIPT_ADD:
+            CASE(OP_SUBSCRIPT_ADD):
                 addSubscript();
-                break;
-            case OP_SUBSCRIPT_INC: 
+                DISPATCH();
+            CASE(OP_SUBSCRIPT_INC): 
                 incSubscript();
-                break;
+                DISPATCH();
                 /*{
                 bool hasError = false;
                 Value value;
@@ -1281,19 +1620,22 @@ static InterpretResult run()
 
                 break;
             }*/
-            case OP_SLICE: {
+            CASE(OP_SLICE): {
                 
-                Value end = pop();
-                Value start = pop();
-                Value item = pop();
+                Value end = peek(0);
+                Value start = peek(1);
+                Value item = peek(2);
                 Value result = slice(item, start, end);
                 if(IS_NIL(result))
                     return INTERPRET_RUNTIME_ERROR;
+                pop();
+                pop();
+                pop();
                 push(result);
 
-                break;
+                DISPATCH();
             }
-            case OP_LIST_ADD: {
+            CASE(OP_LIST_ADD): {
                 Value val = peek(0); // pop();
                 if (!IS_LIST(peek(1)))
                 {
@@ -1303,19 +1645,20 @@ static InterpretResult run()
                 ObjList* list = AS_LIST(peek(1));
 
                 writeValueArray(&list->elements, val);
+                WRITE_BARRIER(list, val);
                 pop();
 
-                break;
+                DISPATCH();
             }
-            case OP_TABLE_ADD: {
+            CASE(OP_TABLE_ADD): {
                 if (!setTable(peek(2), peek(0), peek(1)))
                     return INTERPRET_RUNTIME_ERROR;
 
                 pop();
                 pop();
-                break;
+                DISPATCH();
             }
-            case OP_POP_LIST: {
+            CASE(OP_POP_LIST): {
                 if (!IS_LIST(peek(0)))
                 {
                     runtimeError("Expect list");
@@ -1330,67 +1673,166 @@ static InterpretResult run()
                 push(list->elements.values[list->elements.count-1]);
                 list->elements.count--;
 
-                break;
+                DISPATCH();
             }
-            case OP_JOIN: {
+            CASE(OP_JOIN): {
                 ObjList* list = AS_LIST(peek(0));
                 Value val = join(list);
                 pop();
                 push(val);
-                break;
+                DISPATCH();
             }
-            case OP_FORMAT: 
+            CASE(OP_FORMAT): 
             {
                 Value val = format(peek(0), peek(1));
                 pop();
                 pop();
                 push(val);
-                break;
+                DISPATCH();
             }
-            case OP_RANGE: {
+            CASE(OP_RANGE): {
                 int end = (int)AS_NUMBER(pop());
                 int start = (int)AS_NUMBER(pop());
                 ObjList* list = AS_LIST(peek(0));
+                reserveValueArray(&list->elements,
+                                  list->elements.count + abs(end - start) + 1);
                 for(int i = start; (start > end) ? i >= end : i <= end; (start > end) ? i-- : i++)
                 {
                     writeValueArray(&list->elements, NUMBER_VAL((double)i));
                 }
-                break;
+                DISPATCH();
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) 
+            CASE(OP_SET_GLOBAL): {
+                uint16_t slot = READ_SHORT();
+                if (IS_UNDEFINED(vm.globalValues.values[slot])) 
                 {
-                    tableDelete(&vm.globals, name); 
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                    runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                vm.globalValues.values[slot] = peek(0);
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
+            CASE(OP_JUMP_IF_FALSE): {
                 uint16_t offset = READ_SHORT();
                 if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+                DISPATCH();
             }
-            case OP_JUMP: {
+            CASE(OP_JUMP): {
                 uint16_t offset = READ_SHORT();
                 frame->ip += offset;
-                break;
+                DISPATCH();
             }
-            case OP_LOOP: {
+            CASE(OP_LOOP): {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
-                break;
+                DISPATCH();
+            }
+            CASE(OP_FOR_ITER): {
+                // slots: counter, iterable, loop variable
+                Value* iter = &frame->slots[READ_BYTE()];
+                uint16_t offset = READ_SHORT();
+                int i = (int)AS_NUMBER(iter[0]);
+                Value iterable = iter[1];
+
+                if (IS_LIST(iterable))
+                {
+                    ObjList* list = AS_LIST(iterable);
+                    if (i >= list->elements.count)
+                    {
+                        frame->ip += offset;
+                        DISPATCH();
+                    }
+                    iter[2] = list->elements.values[i];
+                }
+                else if (IS_STRING(iterable))
+                {
+                    ObjString* string = AS_STRING(iterable);
+                    if (i >= string->length)
+                    {
+                        frame->ip += offset;
+                        DISPATCH();
+                    }
+                    iter[2] = OBJ_VAL(CHAR_STRING(string->chars[i]));
+                }
+                else if (IS_TABLE(iterable))
+                {
+                    ObjTable* table = AS_TABLE(iterable);
+                    // keep inserts in the body from compacting the keys
+                    // under the counter until the loop is done
+                    if (i == 0) table->iterators++;
+                    while (i < table->keys.count && IS_UNDEFINED(table->keys.values[i]))
+                        i++;
+                    if (i >= table->keys.count)
+                    {
+                        table->iterators--;
+                        frame->ip += offset;
+                        DISPATCH();
+                    }
+                    iter[2] = table->keys.values[i];
+                }
+                else if (IS_CURSOR(iterable))
+                {
+                    if (!nextRow(AS_CURSOR(iterable), &iter[2]))
+                    {
+                        frame->ip += offset;
+                        DISPATCH();
+                    }
+                }
+                else
+                {
+                    runtimeError("Can only iterate over lists, strings and tables.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                iter[0] = NUMBER_VAL((double)(i + 1));
+                DISPATCH();
+            }
+            CASE(OP_RANGE_BOUND): {
+                // turn the inclusive end of [start..end] into an exclusive bound
+                // one step past it, so OP_FOR_RANGE only has to test equality
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+                {
+                    runtimeError("Only numbers can be used to create a range");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                int end = (int)AS_NUMBER(pop());
+                int start = (int)AS_NUMBER(pop());
+                push(NUMBER_VAL((double)start));
+                push(NUMBER_VAL((double)(start > end ? end - 1 : end + 1)));
+                DISPATCH();
+            }
+            CASE(OP_FOR_RANGE): {
+                // slots: counter, bound, loop variable
+                Value* iter = &frame->slots[READ_BYTE()];
+                uint16_t offset = READ_SHORT();
+                double i = AS_NUMBER(iter[0]);
+                double bound = AS_NUMBER(iter[1]);
+                if (i == bound)
+                {
+                    frame->ip += offset;
+                    DISPATCH();
+                }
+                iter[2] = iter[0];
+                iter[0] = NUMBER_VAL(bound > i ? i + 1 : i - 1);
+                DISPATCH();
+            }
+            CASE(OP_CLOSE_ITER): {
+                // a return from inside a for-in loop ends it: a query's
+                // statement is finished now rather than when the cursor is
+                // collected, and a table may be compacted again
+                Value iterable = frame->slots[READ_BYTE()];
+                if (IS_CURSOR(iterable)) closeCursor(AS_CURSOR(iterable));
+                else if (IS_TABLE(iterable)) AS_TABLE(iterable)->iterators--;
+                DISPATCH();
             }
-            case OP_CALL: {
+            CASE(OP_CALL): {
                 int argCount = READ_BYTE();
                 if (!callValue(peek(argCount), argCount)) 
                     return INTERPRET_RUNTIME_ERROR;
 
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH();
             }
-            case OP_CLOSURE: {
+            CASE(OP_CLOSURE): {
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
                 ObjClosure* closure = newClosure(function);
                 
@@ -1408,75 +1850,81 @@ static InterpretResult run()
                     {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
                 }
-                break;
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
+            CASE(OP_GET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
-                break;
+                DISPATCH();
             }
-            case OP_SET_UPVALUE: {
+            CASE(OP_SET_UPVALUE): {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                *upvalue->location = peek(0);
+                WRITE_BARRIER(upvalue, peek(0));
+                DISPATCH();
             }
-            case OP_CLOSE_UPVALUE:
+            CASE(OP_CLOSE_UPVALUE):
                 closeUpvalues(vm.stackTop - 1);
                 pop();
-                break;
-            case OP_INC_LOCAL: {
+                DISPATCH();
+            CASE(OP_INC_LOCAL): {
                 INC_DEC_OP(frame->slots[slot],1);
-                break;
+                DISPATCH();
             }
-            case OP_INC_UPVALUE: {
+            CASE(OP_INC_UPVALUE): {
                 INC_DEC_OP(*frame->closure->upvalues[slot]->location,1);
-                break;
+                DISPATCH();
             }
-            case OP_DEC_LOCAL: {
+            CASE(OP_DEC_LOCAL): {
                 INC_DEC_OP(frame->slots[slot],-1);
-                break;
+                DISPATCH();
             }
-            case OP_DEC_UPVALUE: {
+            CASE(OP_DEC_UPVALUE): {
                 INC_DEC_OP(*frame->closure->upvalues[slot]->location,-1);
-                break;
+                DISPATCH();
             }
-            case OP_ADD_LOCAL: {
+            CASE(OP_ADD_LOCAL): {
                 ADD_OP(frame->slots[slot]);
-                break;
+                DISPATCH();
             }
-            case OP_ADD_UPVALUE: {
+            CASE(OP_ADD_UPVALUE): {
                 ADD_OP(*frame->closure->upvalues[slot]->location);
-                break;
+                // the slot operand was the last byte read
+                WRITE_BARRIER(frame->closure->upvalues[frame->ip[-1]], peek(0));
+                DISPATCH();
             }
-            case OP_NEW_LIST: {
-                push(OBJ_VAL(newList()));
-                break;
+            CASE(OP_NEW_LIST): {
+                push(OBJ_VAL(newListWithCapacity(READ_SHORT())));
+                DISPATCH();
             }
-            case OP_NEW_TABLE: {
-                push(OBJ_VAL(newTable()));
-                break;
+            CASE(OP_NEW_TABLE): {
+                push(OBJ_VAL(newTableWithCapacity(READ_SHORT())));
+                DISPATCH();
             }
-            case OP_ENUM:
+            CASE(OP_ENUM):
                 push(OBJ_VAL(newEnum(READ_STRING())));
-                break;
-            case OP_ENUM_FIELD:
+                DISPATCH();
+            CASE(OP_ENUM_FIELD):
                 defineEnumField(READ_STRING());
-                break;
-            case OP_ENUM_FIELD_SET:
+                DISPATCH();
+            CASE(OP_ENUM_FIELD_SET):
                 setEnumField(READ_STRING());
-                break;
-            case OP_CLASS:
+                DISPATCH();
+            CASE(OP_CLASS):
                 push(OBJ_VAL(newClass(READ_STRING())));
-                break;
-            case OP_MODULE:
+                DISPATCH();
+            CASE(OP_MODULE):
                 push(OBJ_VAL(newMod(READ_STRING())));
-                break;
-            case OP_GET_PROPERTY: {
+                DISPATCH();
+            CASE(OP_GET_PROPERTY): {
                 if (IS_ENUM(peek(0)))
                 {
                     ObjEnum* _enum = AS_ENUM(peek(0));
                     ObjString* name = READ_STRING();
+                    READ_SHORT(); // enums don't use the inline cache
 
                     Value value;
                     //printf("enum count: %d\n", _enum->fields.count);
@@ -1485,14 +1933,14 @@ static InterpretResult run()
                     {
                         pop(); // Enum.
                         push(value);
-                        break;
+                        DISPATCH();
                     }
                     else
                     {
                         runtimeError("Unknowm enum value '%s'.", name->chars);
                         return INTERPRET_RUNTIME_ERROR;
                     }
-                    break;
+                    DISPATCH();
                 }
                 if (!IS_INSTANCE(peek(0))) 
                 {
@@ -1501,22 +1949,29 @@ static InterpretResult run()
                 }
                 ObjInstance* instance = AS_INSTANCE(peek(0));
                 ObjString* name = READ_STRING();
+                InlineCache* cache = READ_CACHE();
 
                 Value value;
-                if (tableGet(&instance->fields, name, &value)) 
+                bool isField;
+                if (!lookupCached(instance, name, cache, &value, &isField))
                 {
-                    pop(); // Instance.
-                    push(value);
-                    break;
+                    runtimeError("Undefined property '%s'.", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
                 }
 
-                if (!bindMethod(instance->klass, name)) 
+                if (isField) 
                 {
-                    return INTERPRET_RUNTIME_ERROR;
+                    pop(); // Instance.
+                    push(value);
+                    DISPATCH();
                 }
-                break;
+
+                ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(value));
+                pop();
+                push(OBJ_VAL(bound));
+                DISPATCH();
             }
-            case OP_SET_PROPERTY: 
+            CASE(OP_SET_PROPERTY): 
             {
                 if (!IS_INSTANCE(peek(1))) 
                 {
@@ -1525,44 +1980,45 @@ static InterpretResult run()
                 }
 
                 ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjString* name = READ_STRING();
+                setFieldCached(instance, name, READ_CACHE(), peek(0));
                 Value value = pop();
                 pop();
                 push(value);
-                break;
+                DISPATCH();
             }
-            case OP_INC_PROPERTY: 
+            CASE(OP_INC_PROPERTY): 
             {
                 ObjString* propName = READ_STRING();
                 if (!incDecProperty(propName, 1)) return INTERPRET_RUNTIME_ERROR;
-                break;
+                DISPATCH();
                 
             }
-            case OP_DEC_PROPERTY: 
+            CASE(OP_DEC_PROPERTY): 
             {
                 ObjString* propName = READ_STRING();
                 if (!incDecProperty(propName, -1)) return INTERPRET_RUNTIME_ERROR;
-                break;
+                DISPATCH();
             }
-            case OP_ADD_PROPERTY: 
+            CASE(OP_ADD_PROPERTY): 
             {
                 ObjString* propName = READ_STRING();
                 if (!addProperty(propName)) return INTERPRET_RUNTIME_ERROR;
-                break;
+                DISPATCH();
             }
-            case OP_METHOD:
+            CASE(OP_METHOD):
                 defineMethod(READ_STRING());
-                break;
-            case OP_INVOKE: {
+                DISPATCH();
+            CASE(OP_INVOKE): {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
+                if (!invokeCached(method, argCount, READ_CACHE())) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH();
             }
-            case OP_WHERE: {
+            CASE(OP_WHERE): {
                 Value list = peek(1);
                 Value fn = peek(0);
 
@@ -1571,8 +2027,8 @@ static InterpretResult run()
                     runtimeError("Where only works on lists.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                Value filterFunction;
-                if (!tableGet(&vm.globals, vm.whereString, &filterFunction))
+                Value filterFunction = vm.globalValues.values[vm.whereSlot];
+                if (IS_UNDEFINED(filterFunction))
                 {
                     runtimeError("filter missing from core function.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -1583,9 +2039,9 @@ static InterpretResult run()
                 push(list);
                 push(fn);
 
-                break;
+                DISPATCH();
             }
-            case OP_SELECT: {
+            CASE(OP_SELECT): {
                 Value list = peek(1);
                 Value fn = peek(0);
 
@@ -1594,8 +2050,8 @@ static InterpretResult run()
                     runtimeError("select only works on lists.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                Value mapFunction;
-                if (!tableGet(&vm.globals, vm.selectString, &mapFunction))
+                Value mapFunction = vm.globalValues.values[vm.selectSlot];
+                if (IS_UNDEFINED(mapFunction))
                 {
                     runtimeError("map missing from core function.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -1606,9 +2062,9 @@ static InterpretResult run()
                 push(list);
                 push(fn);
 
-                break;
+                DISPATCH();
             }
-            case OP_RETURN: {
+            CASE(OP_RETURN): {
                 Value result = pop();
                 closeUpvalues(frame->slots);
                 vm.frameCount--;
@@ -1621,8 +2077,14 @@ static InterpretResult run()
                 vm.stackTop = frame->slots;
                 push(result);
                 frame = &vm.frames[vm.frameCount - 1];
-                break;
+                DISPATCH();
             }
+            default:
+#ifdef COMPUTED_GOTO
+            op_unknown:
+#endif
+                runtimeError("Unknown opcode %d.", instruction);
+                return INTERPRET_RUNTIME_ERROR;
         }
     }
 
@@ -1630,17 +2092,17 @@ static InterpretResult run()
     #undef READ_CONSTANT
     #undef BINARY_OP
     #undef READ_STRING
+    #undef READ_CACHE
     #undef READ_SHORT
     #undef INC_DEC_OP
     #undef COMPARE_OP
     #undef BINARY_OP_INT
+    #undef CASE
+    #undef DISPATCH
 }
 
-InterpretResult interpret(const char* source, char* filename) 
+static InterpretResult runFunction(ObjFunction* function)
 {
-    ObjFunction* function = compile(source, filename);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
     push(OBJ_VAL(function));
 
     ObjClosure* closure = newClosure(function);
@@ -1651,4 +2113,33 @@ InterpretResult interpret(const char* source, char* filename)
     return run();
 }
 
+InterpretResult interpret(const char* source, char* filename) 
+{
+    ObjFunction* function = compile(source, filename);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+    return runFunction(function);
+}
+
+// Like interpret, but reuses the bytecode cached for the file at path.
+InterpretResult interpretFile(const char* source, char* filename, const char* path)
+{
+#ifdef NO_BYTECODE_CACHE
+    return interpret(source, filename);
+#else
+    ObjFunction* function = loadBytecode(path, source);
+    if (function == NULL)
+    {
+        function = compile(source, filename);
+        if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+        push(OBJ_VAL(function));
+        saveBytecode(path, source, function);
+        pop();
+    }
+
+    return runFunction(function);
+#endif
+}
+
 
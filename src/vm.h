@@ -1,6 +1,8 @@
 #ifndef min_vm_h
 #define min_vm_h
 
+#include <time.h>
+
 #include "chunk.h"
 #include "value.h"
 #include "table.h"
@@ -15,23 +17,46 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+} GCState;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
     Value stack[STACK_MAX];
     Value* stackTop;
-    Obj* objects;
+    Obj* objects;       // young generation, swept by every collection
+    Obj* oldObjects;    // survivors of a collection, swept by full ones only
     Table strings;
-    Table globals;
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
     ObjUpvalue* openUpvalues;
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
     size_t bytesAllocated;
     size_t nextGC;
+    size_t nurseryBytes;
+    GCState gcState;
+    bool gcIncremental;
+    bool markBit;
+    Obj** sweepLink;        // next link to sweep in the old generation
+    size_t stepBytes;
+    clock_t gcBudget;       // longest an incremental step should run
+    clock_t gcMaxPause;
+    int gcCount;
+    int gcMinorCount;
     ObjString* initString;
-    ObjString* whereString;
-    ObjString* selectString;
+    ObjString* charStrings[UINT8_COUNT];    // every one-byte string, see CHAR_STRING
+    int whereSlot;
+    int selectSlot;
 } VM;
 
 typedef enum {
@@ -42,11 +67,16 @@ typedef enum {
 
 extern VM vm;
 
+// Indexing or iterating a string hands out these instead of allocating.
+#define CHAR_STRING(c) (vm.charStrings[(uint8_t)(c)])
+
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source, char* filename);
+InterpretResult interpretFile(const char* source, char* filename, const char* path);
 void push(Value value);
 Value pop();
 bool setTable(Value tableVal, Value item, Value index);
+int globalSlot(ObjString* name);
 
 #endif